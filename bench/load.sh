@@ -0,0 +1,87 @@
+#!/bin/sh
+#
+# Measures denatd's throughput and latency.  Starts denatd in a private user &
+# network namespace (so it doesn't need root), populated with synthetic
+# interfaces, addresses and candidate prefix routes, and drives it with
+# loadgen (built from loadgen.c next to this script).
+#
+#	usage: load.sh [options] path/to/denatd [denatd option ...]
+#
+#	-i count	Interfaces (default 4)
+#	-a count	IPv4 + IPv6 address pairs per interface (default 2)
+#	-r count	Routes with denatd's routing protocol, i.e. delegated
+#			prefixes (default 1)
+#	-c count	Concurrent clients (default 16)
+#	-d seconds	Duration (default 10)
+#	-q request	Request line (default "DENAT/1"; '' sends nothing, like
+#			an old client -- consider passing -w 0 to denatd)
+#
+
+set -e
+
+IFACES=4
+ADDRS=2
+ROUTES=1
+CLIENTS=16
+DURATION=10
+REQUEST=DENAT/1
+PORT=9797
+
+while getopts i:a:r:c:d:q: opt; do
+	case $opt in
+		i)	IFACES=$OPTARG ;;
+		a)	ADDRS=$OPTARG ;;
+		r)	ROUTES=$OPTARG ;;
+		c)	CLIENTS=$OPTARG ;;
+		d)	DURATION=$OPTARG ;;
+		q)	REQUEST=$OPTARG ;;
+		*)	exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+DENATD=${1:?usage: $0 [options] path/to/denatd [denatd option ...]}
+shift
+
+if [ -z "$DENAT_BENCH_NS" ]; then
+	BENCH=$(cd "$(dirname "$0")" && pwd)
+	TMP=$(mktemp -d)
+	trap 'rm -rf "$TMP"' EXIT
+	${CC:-cc} -O2 -Wall -o "$TMP/loadgen" "$BENCH/loadgen.c"
+	DENAT_BENCH_NS=1 LOADGEN=$TMP/loadgen unshare -Urn "$0" \
+		-i "$IFACES" -a "$ADDRS" -r "$ROUTES" -c "$CLIENTS" \
+		-d "$DURATION" -q "$REQUEST" "$DENATD" "$@"
+	exit
+fi
+
+ip link set lo up
+
+i=0
+while [ $i -lt "$IFACES" ]; do
+	ip link add bench$i type veth peer name peer$i
+	ip link set bench$i up
+	ip link set peer$i up
+	j=1
+	while [ $j -le "$ADDRS" ]; do
+		ip addr add 198.18.$i.$j/24 dev bench$i
+		ip -6 addr add 2001:db8:$i::$j/64 dev bench$i nodad
+		j=$((j + 1))
+	done
+	i=$((i + 1))
+done
+
+i=0
+while [ $i -lt "$ROUTES" ]; do
+	ip -6 route add unreachable 2001:db8:$((i + 256))::/48 proto 255
+	i=$((i + 1))
+done
+
+echo "$IFACES interfaces, $((IFACES * ADDRS * 2)) addresses," \
+     "$ROUTES routes; request: '$REQUEST'"
+
+"$DENATD" -d -p $PORT "$@" &
+PID=$!
+trap 'kill $PID 2> /dev/null' EXIT
+sleep 0.5
+
+"$LOADGEN" -p $PORT -c "$CLIENTS" -d "$DURATION" -q "$REQUEST"
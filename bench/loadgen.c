@@ -0,0 +1,311 @@
+/*
+ * Copyright 2019 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *	http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Load generator for denatd (see load.sh).  Runs a number of concurrent
+ * clients, each of which repeatedly connects, sends the request line (if
+ * any), and reads the response until denatd closes the connection -- which
+ * is what denatc's get_firewall_ips() does.  Reports requests per second and
+ * latency percentiles (connect to EOF).
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#define MAX_EVENTS	256
+
+struct client {
+	int64_t start;
+	size_t sent;
+	int fd;
+};
+
+static struct sockaddr_in6 server;
+static const char *request = "DENAT/1\n";
+static size_t request_len;
+
+static uint32_t *latencies;
+static size_t num_latencies, max_latencies;
+static uint64_t errors, bytes;
+
+static int epoll_fd;
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+__attribute__((noreturn))
+static void die(const char *const what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+__attribute__((noreturn))
+static void usage(const char *const name)
+{
+	fprintf(stderr, "Usage: %s [-a address] [-p port] [-c clients] "
+		"[-d seconds] [-q request]\n"
+		"\t(-q '' sends no request, like an old client)\n", name);
+	exit(EXIT_FAILURE);
+}
+
+static void record(const int64_t latency)
+{
+	if (num_latencies == max_latencies) {
+		max_latencies = max_latencies ? max_latencies * 2 : 65536;
+		latencies = realloc(latencies,
+				    max_latencies * sizeof *latencies);
+		if (latencies == NULL)
+			die("realloc");
+	}
+
+	latencies[num_latencies++] = (uint32_t)latency;
+}
+
+static void start_client(struct client *const c)
+{
+	struct epoll_event ev;
+
+	c->fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd < 0)
+		die("socket");
+
+	c->start = now_us();
+	c->sent = 0;
+
+	if (connect(c->fd, (struct sockaddr *)&server, sizeof server) < 0
+			&& errno != EINPROGRESS)
+		die("connect");
+
+	ev.events = request_len > 0 ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+		die("epoll_ctl");
+}
+
+static void finish_client(struct client *const c, const _Bool ok)
+{
+	if (ok)
+		record(now_us() - c->start);
+	else
+		++errors;
+
+	close(c->fd);
+}
+
+/* Returns 1 when the exchange is complete */
+static int client_event(struct client *const c)
+{
+	struct epoll_event ev;
+	char buf[65536];
+	ssize_t ret;
+
+	if (c->sent < request_len) {
+
+		ret = send(c->fd, request + c->sent, request_len - c->sent,
+			   MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			finish_client(c, 0);
+			return 1;
+		}
+
+		c->sent += ret;
+		if (c->sent < request_len)
+			return 0;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+			die("epoll_ctl");
+	}
+
+	while (1) {
+
+		ret = recv(c->fd, buf, sizeof buf, 0);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			finish_client(c, 0);
+			return 1;
+		}
+
+		if (ret == 0) {
+			finish_client(c, 1);
+			return 1;
+		}
+
+		bytes += ret;
+	}
+}
+
+static int cmp_u32(const void *const a, const void *const b)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const double p)
+{
+	size_t i;
+
+	i = (size_t)(p * (double)num_latencies);
+	if (i >= num_latencies)
+		i = num_latencies - 1;
+
+	return latencies[i] / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event events[MAX_EVENTS];
+	unsigned clients, duration;
+	struct client *c;
+	int64_t end, now;
+	double elapsed;
+	int i, n, opt;
+
+	memset(&server, 0, sizeof server);
+	server.sin6_family = AF_INET6;
+	server.sin6_addr = in6addr_loopback;
+	server.sin6_port = htons(9797);
+	clients = 16;
+	duration = 10;
+
+	while ((opt = getopt(argc, argv, "a:p:c:d:q:")) != -1) {
+
+		switch (opt) {
+
+			case 'a':
+				if (inet_pton(AF_INET6, optarg,
+					      &server.sin6_addr) != 1)
+					usage(argv[0]);
+				break;
+
+			case 'p':
+				server.sin6_port = htons(atoi(optarg));
+				break;
+
+			case 'c':
+				clients = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'd':
+				duration = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'q':
+				request = optarg;
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (clients == 0 || duration == 0)
+		usage(argv[0]);
+
+	/* The request line is given without its newline */
+	if (*request != 0 && request[strlen(request) - 1] != '\n') {
+		char *line;
+
+		if (asprintf(&line, "%s\n", request) < 0)
+			die("asprintf");
+		request = line;
+	}
+
+	request_len = strlen(request);
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		die("epoll_create1");
+
+	if ((c = calloc(clients, sizeof *c)) == NULL)
+		die("calloc");
+
+	now = now_us();
+	end = now + (int64_t)duration * 1000000;
+
+	for (i = 0; i < (int)clients; ++i)
+		start_client(&c[i]);
+
+	/* Clients are only restarted until the time is up */
+	n = clients;
+
+	while (n > 0) {
+
+		int ready;
+
+		ready = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			die("epoll_wait");
+		}
+
+		now = now_us();
+
+		for (i = 0; i < ready; ++i) {
+
+			if (!client_event(events[i].data.ptr))
+				continue;
+
+			if (now < end)
+				start_client(events[i].data.ptr);
+			else
+				--n;
+		}
+	}
+
+	elapsed = (now - (end - (int64_t)duration * 1000000)) / 1e6;
+
+	if (num_latencies == 0) {
+		fprintf(stderr, "No successful requests (%" PRIu64 " errors)\n",
+			errors);
+		return EXIT_FAILURE;
+	}
+
+	qsort(latencies, num_latencies, sizeof *latencies, cmp_u32);
+
+	printf("clients:   %u\n", clients);
+	printf("requests:  %zu (%" PRIu64 " errors)\n", num_latencies, errors);
+	printf("bytes:     %" PRIu64 "\n", bytes);
+	printf("req/s:     %.0f\n", num_latencies / elapsed);
+	printf("p50:       %.3f ms\n", percentile(0.50));
+	printf("p99:       %.3f ms\n", percentile(0.99));
+	printf("p99.9:     %.3f ms\n", percentile(0.999));
+	printf("max:       %.3f ms\n", latencies[num_latencies - 1] / 1000.0);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2019 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *	http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Netlink parser microbenchmark.  Feeds a capture (denatd -R|--record) or a
+ * synthetic IPv6 route dump through denatd's own callbacks (msg_cb etc.), and
+ * reports the parse throughput.  No root or routing table required.
+ *
+ *	cc -O2 -pthread -I/path/to/libmnl/include -o parse parse.c -lmnl
+ *
+ *	parse [-f capture | -n routes [-m candidates] [-o capture]] [-r runs]
+ */
+
+#define main denatd_main
+#include "../denatd.c"
+#undef main
+
+/* Builds dump buffers like the kernel's, with NLM_F_MULTI set */
+static void synthesize(struct capture *const cap, const unsigned routes,
+		       const unsigned candidates)
+{
+	struct buffer b = { 0 };
+	struct in6_addr dst;
+	struct nlmsghdr *nlh;
+	struct rtmsg *rtm;
+	uint8_t *msg;
+	uint32_t len32;
+	size_t used;
+	unsigned i;
+
+	breset(&b);
+	bput(&b, CAPTURE_MAGIC, sizeof CAPTURE_MAGIC - 1);
+
+	if ((msg = malloc(NL_BUFSIZE)) == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	used = 0;
+
+	for (i = 0; i <= routes; ++i) {
+
+		/* Flush the buffer when the next message might not fit */
+		if (i == routes || NL_BUFSIZE - used < 256) {
+			len32 = used;
+			bput(&b, &len32, sizeof len32);
+			bput(&b, msg, used);
+			used = 0;
+			if (i == routes)
+				break;
+		}
+
+		nlh = mnl_nlmsg_put_header(msg + used);
+		nlh->nlmsg_type = RTM_NEWROUTE;
+		nlh->nlmsg_flags = NLM_F_MULTI;
+		nlh->nlmsg_seq = 1;
+
+		rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
+		rtm->rtm_family = AF_INET6;
+		rtm->rtm_table = RT_TABLE_MAIN;
+		rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+
+		memset(&dst, 0, sizeof dst);
+		dst.s6_addr[0] = 0x30;
+		dst.s6_addr[1] = (uint8_t)(i >> 16);
+		dst.s6_addr[2] = (uint8_t)(i >> 8);
+		dst.s6_addr[3] = (uint8_t)i;
+
+		if (i < candidates) {
+			rtm->rtm_protocol = rtproto;
+			rtm->rtm_type = RTN_UNREACHABLE;
+			rtm->rtm_dst_len = 48;
+		}
+		else {
+			rtm->rtm_protocol = RTPROT_BGP;
+			rtm->rtm_type = RTN_UNICAST;
+			rtm->rtm_dst_len = 32;
+		}
+
+		mnl_attr_put_u32(nlh, RTA_TABLE, RT_TABLE_MAIN);
+		mnl_attr_put(nlh, RTA_DST, sizeof dst, &dst);
+		mnl_attr_put_u32(nlh, RTA_PRIORITY, 1024);
+		mnl_attr_put_u32(nlh, RTA_OIF, 2);
+
+		used += nlh->nlmsg_len;
+	}
+
+	free(msg);
+
+	cap->data = (uint8_t *)b.data;
+	cap->len = b.len;
+}
+
+static size_t count_messages(const struct capture *const cap)
+{
+	const struct nlmsghdr *nlh;
+	const uint8_t *buf;
+	size_t offset, len, count;
+	int left;
+
+	count = 0;
+
+	for (offset = 0; (buf = capture_next(cap, &offset, &len)) != NULL; ) {
+		left = len;
+		for (nlh = (const struct nlmsghdr *)buf; mnl_nlmsg_ok(nlh, left);
+					nlh = mnl_nlmsg_next(nlh, &left))
+			++count;
+	}
+
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned routes, candidates, runs, run;
+	const char *file, *output;
+	struct capture cap;
+	const uint8_t *buf;
+	size_t offset, len, messages;
+	int64_t start, best, elapsed;
+	int opt, fd;
+
+	file = output = NULL;
+	routes = 100000;
+	candidates = 1;
+	runs = 10;
+	debug = 1;
+
+	while ((opt = getopt(argc, argv, "f:n:m:o:r:")) != -1) {
+
+		switch (opt) {
+			case 'f':	file = optarg;				break;
+			case 'n':	routes = strtoul(optarg, NULL, 0);	break;
+			case 'm':	candidates = strtoul(optarg, NULL, 0);	break;
+			case 'o':	output = optarg;			break;
+			case 'r':	runs = strtoul(optarg, NULL, 0);	break;
+			default:
+				fprintf(stderr, "Usage: %s [-f capture | -n "
+					"routes [-m candidates] [-o capture]] "
+					"[-r runs]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (file != NULL)
+		capture_load(file, &cap);
+	else
+		synthesize(&cap, routes, candidates);
+
+	if (output != NULL) {
+		fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(output);
+			return EXIT_FAILURE;
+		}
+		write_all(fd, cap.data, cap.len, output);
+		close(fd);
+	}
+
+	messages = count_messages(&cap);
+	best = INT64_MAX;
+
+	for (run = 0; run < runs || run == 0; ++run) {
+
+		cache_clear();
+		start = now_us();
+
+		for (offset = 0; (buf = capture_next(&cap, &offset, &len))
+								!= NULL; )
+			mnl_cb_run(buf, len, 0, 0, msg_cb, NULL);
+
+		elapsed = now_us() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+
+	if (best == 0)
+		best = 1;
+
+	printf("messages:  %zu (%zu bytes)\n", messages, cap.len);
+	printf("cached:    %zu interfaces, %zu addresses, %zu routes\n",
+	       cache.num_ifaces, cache.num_addrs, cache.num_routes);
+	printf("best of %u: %.3f ms\n", runs, best / 1000.0);
+	printf("msgs/s:    %.0f\n", messages / (best / 1e6));
+	printf("ns/msg:    %.1f\n", best * 1000.0 / messages);
+	printf("MB/s:      %.1f\n", cap.len / (double)best);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Compares the time denatd takes to build its cache with and without
+# kernel-side route dump filtering (-n|--no-strict), on a synthetic full
+# IPv6 routing table.  Runs in a private user & network namespace, so it
+# doesn't need root.
+#
+#	usage: route-dump.sh path/to/denatd [routes [runs]]
+#
+
+set -e
+
+DENATD=${1:?usage: $0 path/to/denatd [routes [runs]]}
+ROUTES=${2:-200000}
+RUNS=${3:-5}
+
+if [ -z "$DENAT_BENCH_NS" ]; then
+	export DENAT_BENCH_NS=1
+	exec unshare -Urn "$0" "$@"
+fi
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+ip link set lo up
+ip link add bench0 type veth peer name bench1
+ip link set bench0 up
+ip link set bench1 up
+ip -6 addr add 2001:db8::1/64 dev bench0 nodad
+
+# The delegated prefix, plus a "full table" of BGP routes
+ip -6 route add unreachable 2001:db8:1::/48 proto 255
+awk -v n="$ROUTES" 'BEGIN {
+	for (i = 0; i < n; ++i)
+		printf "route add 3%03x:%x::/32 dev bench0 proto bgp\n",
+		       int(i / 65536), i % 65536
+}' > "$TMP/routes"
+ip -6 -batch "$TMP/routes"
+
+echo "$(ip -6 route show | wc -l) IPv6 routes"
+
+run() {
+	"$DENATD" -d -v -p 0 "$@" 2> "$TMP/log" &
+	pid=$!
+	while ! grep -q '^denatd: Cache:' "$TMP/log"; do
+		sleep 0.05
+	done
+	kill $pid
+	wait $pid 2> /dev/null || true
+	sed -n 's/^denatd: Cache: .*(\([0-9]*\) ms)$/\1/p' "$TMP/log"
+}
+
+for mode in strict no-strict; do
+	opt=
+	[ $mode = no-strict ] && opt=-n
+	total=0
+	for i in $(seq "$RUNS"); do
+		ms=$(run $opt)
+		total=$((total + ms))
+	done
+	echo "$mode: $((total / RUNS)) ms (average of $RUNS)"
+done
@@ -14,19 +14,31 @@
  *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
  */
 
-#define _BSD_SOURCE		/* for vsyslog */
+#define _GNU_SOURCE		/* for vsyslog, accept4, CPU_SET & memfd_create */
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
-#include <ifaddrs.h>
+#include <net/if.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
@@ -35,9 +47,12 @@
 
 #include <libmnl/libmnl.h>
 #include <linux/rtnetlink.h>
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
 
 #define EXEC_NAME	"denatd"
-#define OUTBUF_SIZE	1000
+#define MAX_EVENTS	64
+#define PROTO_VERSION	1
 
 /*
  *      Command-line options
@@ -52,16 +67,117 @@ static _Bool verbose = 0;
 /* Listen port (host byte order) */
 static uint16_t lport = 9797;
 
-static sa_family_t ip_version = AF_UNSPEC;
+/* IPv4 only (-4|--ipv4)?  Only affects the default listen address. */
+static _Bool ipv4_only = 0;
 
-/* INADDR_ANY is 0x00000000, so byte order doesn't matter */
-static struct in_addr laddr4 = { .s_addr = INADDR_ANY };
+/*
+ * Listen addresses (-l|--listen), all served by one process with the same
+ * cache.  The default is the IPv6 wildcard (which also accepts IPv4, unless
+ * the system is configured otherwise), or the IPv4 wildcard with -4.
+ */
+#define LISTEN_MAX	16
+
+struct laddr {
+	sa_family_t family;
+	struct in_addr in;		/* AF_INET */
+	struct in6_addr in6;		/* AF_INET6 */
+};
+
+static struct laddr laddrs[LISTEN_MAX];
+static unsigned num_laddrs = 0;
 
-static struct in6_addr laddr6 = IN6ADDR_ANY_INIT;
+/* Set if there are IPv4 listen addresses, which IPv6 sockets mustn't take */
+static _Bool v6only = 0;
 
 /* Routing protocol number */
 static uint8_t rtproto = 255;
 
+/* Lengths of delegated prefixes (candidate routes) */
+static uint8_t prefix_min = 48;
+static uint8_t prefix_max = 56;
+
+/*
+ * Uplinks (-U|--uplink <name>=<table>).  Candidate routes in an uplink's
+ * routing table are tagged with its name, so clients can tell the prefixes
+ * delegated by different upstreams apart.
+ */
+#define UPLINK_MAX	16
+#define UPLINK_NAMESIZE	16
+
+struct uplink {
+	char name[UPLINK_NAMESIZE];
+	uint32_t table;
+};
+
+static struct uplink uplinks[UPLINK_MAX];
+static unsigned num_uplinks = 0;
+
+/*
+ * Clients allowed to connect or query (-A|--allow <prefix>); packets from
+ * anyone else are dropped by the kernel (see Client filter).  No prefixes
+ * means no filter.
+ */
+#define ALLOW_MAX	64
+
+struct allow {
+	sa_family_t family;
+	uint8_t plen;
+	uint8_t addr[16];	/* network byte order; only 4 used for AF_INET */
+};
+
+static struct allow allows[ALLOW_MAX];
+static unsigned num_allows = 0;
+
+/* Listen queue length */
+static int backlog = 128;
+
+/* Time allowed for a client to read its response (milliseconds) */
+static int64_t conn_timeout = 5000;
+
+/* Time to wait for a request before assuming an old client (milliseconds) */
+static int64_t request_wait = 100;
+
+/* Interval between keepalives sent to subscribers (milliseconds) */
+static int64_t keepalive = 30000;
+
+/* Time a persistent connection may wait for its next request (milliseconds) */
+static int64_t persist_idle = 120000;
+
+/* Requests allowed on one persistent connection */
+static unsigned persist_max = 1000;
+
+/*
+ * Unsent data allowed to build up behind the output that a connection is
+ * sending (bytes), before the connection is dropped; this limits clients
+ * that don't keep up, not the size of a response
+ */
+static size_t unsent_max = 1024 * 1024;
+
+/* Also answer queries on a UDP socket? */
+static _Bool udp = 0;
+
+/* Unix socket for metrics (NULL for none) */
+static const char *metrics_path = NULL;
+
+/* Shared snapshot file (see Shared snapshot; NULL for none) */
+static const char *shm_path = NULL;
+
+/* Netlink capture files (see Netlink captures) */
+static const char *record_path = NULL;
+static const char *replay_path = NULL;
+
+/* Ask the kernel to filter route dumps (if it can)?  Off for comparison. */
+static _Bool strict_dump = 1;
+
+/* Worker threads, each with its own listening socket(s) (see Workers) */
+static unsigned num_workers = 1;
+
+/* Steer connections and queries to the worker for the receiving CPU? */
+static _Bool cpu_steer = 0;
+
+/* Exit when idle for this long (milliseconds; 0 for never) */
+static int64_t idle_timeout = 0;
+
 /*
  *      Logging
  */
@@ -119,6 +235,35 @@ static void info(const char *fmt, ...)
 	va_end(ap);
 }
 
+/* Monotonic clock, in microseconds */
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		error("clock_gettime: %m\n");
+		abort();
+	}
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Monotonic clock, in milliseconds */
+static int64_t now_ms(void)
+{
+	return now_us() / 1000;
+}
+
+/* pthread functions return an error number, rather than setting errno */
+static void pthread_check(const int ret, const char *const func)
+{
+	if (ret != 0) {
+		errno = ret;
+		error("%s: %m\n", func);
+		abort();
+	}
+}
+
 /*
  *	Option parsing
  */
@@ -127,17 +272,30 @@ __attribute__((noreturn))
 static void show_help(int status)
 {
 	printf("Usage: %s [-4|--ipv4] [-d|--debug] [-v|--verbose] [-h|--help]\n"
-	       "\t[-l|--listen address] [-p|--port port] "
-	       "[-r|--rtproto proto]\n",
+	       "\t[-l|--listen address]... [-p|--port port] "
+	       "[-r|--rtproto proto]\n"
+	       "\t[-A|--allow prefix]...\n"
+	       "\t[-L|--prefix-min length] [-M|--prefix-max length] "
+	       "[-U|--uplink name=table]\n"
+	       "\t[-b|--backlog length] [-t|--timeout seconds] "
+	       "[-w|--wait milliseconds]\n"
+	       "\t[-k|--keepalive seconds] [-I|--persist-idle seconds] "
+	       "[-Q|--persist-max count]\n"
+	       "\t[-O|--unsent-max kilobytes]\n"
+	       "\t[-n|--no-strict] [-u|--udp]\n"
+	       "\t[-m|--metrics path] [-S|--shm path] [-R|--record file] "
+	       "[-P|--replay file]\n"
+	       "\t[-T|--threads count] [-C|--cpu-steer] "
+	       "[-i|--idle-timeout seconds]\n",
 	       EXEC_NAME);
 	exit(status);
 }
 
-static void ip_version_mismatch(void)
+static void ip_version_mismatch(const struct in6_addr *const addr)
 {
 	char buf[INET6_ADDRSTRLEN];
 
-	if (inet_ntop(AF_INET6, &laddr6, buf, sizeof buf) == NULL) {
+	if (inet_ntop(AF_INET6, addr, buf, sizeof buf) == NULL) {
 		perror("inet_ntop");
 		abort();
 	}
@@ -167,13 +325,90 @@ static int parse_ipv4(int i __attribute__((unused)),
 		      int argc __attribute__((unused)),
 		      char *argv[] __attribute__((unused)))
 {
-	if (ip_version == AF_INET6)
-		ip_version_mismatch();
+	unsigned j;
+
+	for (j = 0; j < num_laddrs; ++j) {
+		if (laddrs[j].family == AF_INET6)
+			ip_version_mismatch(&laddrs[j].in6);
+	}
+
+	ipv4_only = 1;
+	return 0;
+}
+
+static int parse_nostrict(int i __attribute__((unused)),
+			  int argc __attribute__((unused)),
+			  char *argv[] __attribute__((unused)))
+{
+	strict_dump = 0;
+	return 0;
+}
+
+static int parse_udp(int i __attribute__((unused)),
+		     int argc __attribute__((unused)),
+		     char *argv[] __attribute__((unused)))
+{
+	udp = 1;
+	return 0;
+}
 
-	ip_version = AF_INET;
+static int parse_cpu_steer(int i __attribute__((unused)),
+			   int argc __attribute__((unused)),
+			   char *argv[] __attribute__((unused)))
+{
+	cpu_steer = 1;
 	return 0;
 }
 
+static int parse_metrics(int i, int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+
+	if (++i >= argc) {
+		fprintf(stderr, "%s: %s option requires an argument\n",
+			EXEC_NAME, argv[i - 1]);
+		show_help(EXIT_FAILURE);
+	}
+
+	if (*argv[i] == 0 || strlen(argv[i]) >= sizeof addr.sun_path) {
+		fprintf(stderr, "%s: invalid argument for %s option: '%s'\n",
+			EXEC_NAME, argv[i - 1], argv[i]);
+		show_help(EXIT_FAILURE);
+	}
+
+	metrics_path = argv[i];
+	return 1;
+}
+
+static const char *parse_path(int i, int argc, char *argv[])
+{
+	if (++i >= argc) {
+		fprintf(stderr, "%s: %s option requires an argument\n",
+			EXEC_NAME, argv[i - 1]);
+		show_help(EXIT_FAILURE);
+	}
+
+	return argv[i];
+}
+
+static int parse_record(int i, int argc, char *argv[])
+{
+	record_path = parse_path(i, argc, argv);
+	return 1;
+}
+
+static int parse_shm(int i, int argc, char *argv[])
+{
+	shm_path = parse_path(i, argc, argv);
+	return 1;
+}
+
+static int parse_replay(int i, int argc, char *argv[])
+{
+	replay_path = parse_path(i, argc, argv);
+	return 1;
+}
+
 static int parse_help(int i __attribute((unused)),
 		      int argc __attribute((unused)),
 		      char *argv[] __attribute__((unused)))
@@ -181,10 +416,10 @@ static int parse_help(int i __attribute((unused)),
 	show_help(EXIT_SUCCESS);
 }
 
-static int parse_lport(int i, int argc, char *argv[])
+static long parse_number(int i, int argc, char *argv[], long min, long max)
 {
 	char *endptr;
-	long port;
+	long value;
 
 	if (++i >= argc) {
 		fprintf(stderr, "%s: %s option requires an argument\n",
@@ -193,27 +428,52 @@ static int parse_lport(int i, int argc, char *argv[])
 	}
 
 	if (isspace(*argv[i]) || *argv[i] == 0)
-		goto invalid_port;
+		goto invalid_number;
 
 	errno = 0;
-	port = strtol(argv[i], &endptr, 0);
-	if (errno != 0 || *endptr != 0 || port < 0 || port > UINT16_MAX)
-		goto invalid_port;
+	value = strtol(argv[i], &endptr, 0);
+	if (errno != 0 || *endptr != 0 || value < min || value > max)
+		goto invalid_number;
 
-	lport = (uint16_t)port;
+	return value;
 
-	return 1;
-
-invalid_port:
+invalid_number:
 	fprintf(stderr, "%s: invalid argument for %s option: '%s'\n",
 		EXEC_NAME, argv[i - 1], argv[i]);
 	show_help(EXIT_FAILURE);
 }
 
+static int parse_lport(int i, int argc, char *argv[])
+{
+	lport = (uint16_t)parse_number(i, argc, argv, 0, UINT16_MAX);
+	return 1;
+}
+
 static int parse_rtproto(int i, int argc, char *argv[])
 {
-	char *endptr;
-	long proto;
+	rtproto = (uint8_t)parse_number(i, argc, argv, 0, UINT8_MAX);
+	return 1;
+}
+
+static int parse_prefix_min(int i, int argc, char *argv[])
+{
+	prefix_min = (uint8_t)parse_number(i, argc, argv, 1, 128);
+	return 1;
+}
+
+static int parse_prefix_max(int i, int argc, char *argv[])
+{
+	prefix_max = (uint8_t)parse_number(i, argc, argv, 1, 128);
+	return 1;
+}
+
+static int parse_uplink(int i, int argc, char *argv[])
+{
+	struct uplink *u;
+	unsigned long table;
+	const char *c;
+	char *end;
+	size_t len;
 
 	if (++i >= argc) {
 		fprintf(stderr, "%s: %s option requires an argument\n",
@@ -221,39 +481,196 @@ static int parse_rtproto(int i, int argc, char *argv[])
 		show_help(EXIT_FAILURE);
 	}
 
-	if (isspace(*argv[i]) || *argv[i] == 0)
-		goto invalid_proto;
+	if (num_uplinks == UPLINK_MAX) {
+		fprintf(stderr, "%s: too many uplinks (maximum %d)\n",
+			EXEC_NAME, UPLINK_MAX);
+		show_help(EXIT_FAILURE);
+	}
 
-	errno = 0;
-	proto = strtol(argv[i], &endptr, 0);
-	if (errno != 0 || *endptr != 0 || proto < 0 || proto > UINT8_MAX)
-		goto invalid_proto;
+	u = &uplinks[num_uplinks];
 
-	rtproto = (uint8_t)proto;
+	/* Names appear in text responses, so no spaces etc. */
+	for (c = argv[i]; isalnum(*c) || *c == '-' || *c == '_' || *c == '.';
+									++c);
+	len = c - argv[i];
 
+	table = 0;
+	if (*c == '=' && isdigit(c[1])) {
+		errno = 0;
+		table = strtoul(c + 1, &end, 10);
+		if (*end != 0 || errno != 0 || table > UINT32_MAX)
+			table = 0;
+	}
+
+	if (len == 0 || len >= sizeof u->name || table == 0) {
+		fprintf(stderr, "%s: invalid argument for %s option: '%s'\n",
+			EXEC_NAME, argv[i - 1], argv[i]);
+		show_help(EXIT_FAILURE);
+	}
+
+	memcpy(u->name, argv[i], len);
+	u->name[len] = 0;
+	u->table = table;
+
+	++num_uplinks;
+	return 1;
+}
+
+static int parse_allow(int i, int argc, char *argv[])
+{
+	char buf[INET6_ADDRSTRLEN];
+	unsigned long plen;
+	struct allow *a;
+	unsigned bits, j;
+	const char *c;
+	char *end;
+
+	if (++i >= argc) {
+		fprintf(stderr, "%s: %s option requires an argument\n",
+			EXEC_NAME, argv[i - 1]);
+		show_help(EXIT_FAILURE);
+	}
+
+	if (num_allows == ALLOW_MAX) {
+		fprintf(stderr, "%s: too many allowed prefixes (maximum %d)\n",
+			EXEC_NAME, ALLOW_MAX);
+		show_help(EXIT_FAILURE);
+	}
+
+	a = &allows[num_allows];
+
+	/* The address, without any /length */
+	c = strchr(argv[i], '/');
+	if (c == NULL)
+		c = argv[i] + strlen(argv[i]);
+	if ((size_t)(c - argv[i]) >= sizeof buf)
+		goto invalid;
+	memcpy(buf, argv[i], c - argv[i]);
+	buf[c - argv[i]] = 0;
+
+	if (inet_pton(AF_INET6, buf, a->addr) == 1)
+		a->family = AF_INET6;
+	else if (inet_pton(AF_INET, buf, a->addr) == 1)
+		a->family = AF_INET;
+	else
+		goto invalid;
+
+	bits = a->family == AF_INET ? 32 : 128;
+	plen = bits;
+
+	if (*c == '/') {
+		if (!isdigit(c[1]))
+			goto invalid;
+		errno = 0;
+		plen = strtoul(c + 1, &end, 10);
+		if (*end != 0 || errno != 0 || plen > bits)
+			goto invalid;
+	}
+
+	/* IPv4 clients of IPv6 sockets still send IPv4 packets */
+	if (a->family == AF_INET6 && plen >= 96
+			&& IN6_IS_ADDR_V4MAPPED((struct in6_addr *)a->addr)) {
+		memmove(a->addr, a->addr + 12, 4);
+		a->family = AF_INET;
+		plen -= 96;
+		bits = 32;
+	}
+
+	a->plen = plen;
+
+	/* Host bits are ignored */
+	for (j = plen; j < bits; ++j)
+		a->addr[j / 8] &= ~(0x80 >> (j % 8));
+
+	++num_allows;
 	return 1;
 
-invalid_proto:
+invalid:
 	fprintf(stderr, "%s: invalid argument for %s option: '%s'\n",
 		EXEC_NAME, argv[i - 1], argv[i]);
 	show_help(EXIT_FAILURE);
 }
 
+static int parse_backlog(int i, int argc, char *argv[])
+{
+	backlog = (int)parse_number(i, argc, argv, 1, 65535);
+	return 1;
+}
+
+static int parse_timeout(int i, int argc, char *argv[])
+{
+	conn_timeout = parse_number(i, argc, argv, 1, 3600) * 1000;
+	return 1;
+}
+
+static int parse_wait(int i, int argc, char *argv[])
+{
+	request_wait = parse_number(i, argc, argv, 0, 10000);
+	return 1;
+}
+
+static int parse_keepalive(int i, int argc, char *argv[])
+{
+	keepalive = parse_number(i, argc, argv, 1, 3600) * 1000;
+	return 1;
+}
+
+static int parse_persist_idle(int i, int argc, char *argv[])
+{
+	persist_idle = parse_number(i, argc, argv, 0, 3600) * 1000;
+	return 1;
+}
+
+static int parse_persist_max(int i, int argc, char *argv[])
+{
+	persist_max = (unsigned)parse_number(i, argc, argv, 1, 1000000);
+	return 1;
+}
+
+static int parse_unsent_max(int i, int argc, char *argv[])
+{
+	unsent_max = (size_t)parse_number(i, argc, argv, 1, 1048576) * 1024;
+	return 1;
+}
+
+static int parse_threads(int i, int argc, char *argv[])
+{
+	num_workers = (unsigned)parse_number(i, argc, argv, 1, CPU_SETSIZE);
+	return 1;
+}
+
+static int parse_idle(int i, int argc, char *argv[])
+{
+	idle_timeout = parse_number(i, argc, argv, 0, 86400) * 1000;
+	return 1;
+}
+
 static int parse_laddr(int i, int argc, char *argv[])
 {
+	struct laddr *la;
+
 	if (++i >= argc) {
 		fprintf(stderr, "%s: %s option requires an argument\n",
 			EXEC_NAME, argv[i - 1]);
 		show_help(EXIT_FAILURE);
 	}
 
-	if (inet_pton(AF_INET6, argv[i], &laddr6) == 1) {
-		if (ip_version == AF_INET)
-			ip_version_mismatch();
-		ip_version = AF_INET6;
+	if (num_laddrs == LISTEN_MAX) {
+		fprintf(stderr, "%s: too many listen addresses (maximum %d)\n",
+			EXEC_NAME, LISTEN_MAX);
+		show_help(EXIT_FAILURE);
+	}
+
+	la = &laddrs[num_laddrs];
+
+	if (inet_pton(AF_INET6, argv[i], &la->in6) == 1) {
+		if (ipv4_only)
+			ip_version_mismatch(&la->in6);
+		la->family = AF_INET6;
 	}
-	else if (inet_pton(AF_INET, argv[i], &laddr4) == 1) {
-		ip_version = AF_INET;
+	else if (inet_pton(AF_INET, argv[i], &la->in) == 1) {
+		la->family = AF_INET;
+		v6only = 1;
 	}
 	else {
 		fprintf(stderr, "%s: invalid argument for %s option: '%s'\n",
@@ -261,6 +678,7 @@ static int parse_laddr(int i, int argc, char *argv[])
 		show_help(EXIT_FAILURE);
 	}
 
+	++num_laddrs;
 	return 1;
 }
 
@@ -269,17 +687,38 @@ struct option {
 	const char *long_opt;
 	int (*parse_fn)(int i, int argc, char *argv[]);
 	_Bool called;
+	_Bool repeatable;
 };
 
 static struct option  options[] = {
-	{ "-4",	"--ipv4", 	parse_ipv4, 	0 },
-	{ "-d", "--debug", 	parse_debug, 	0 },
-	{ "-v", "--verbose",	parse_verbose,	0 },
-	{ "-p", "--port", 	parse_lport, 	0 },
-	{ "-l", "--listen", 	parse_laddr, 	0 },
-	{ "-r", "--rtproto",	parse_rtproto,	0 },
-	{ "-h", "--help", 	parse_help, 	0 },
-	{ NULL, NULL, 		0, 		0 }
+	{ "-4",	"--ipv4", 	parse_ipv4, 	0, 0 },
+	{ "-d", "--debug", 	parse_debug, 	0, 0 },
+	{ "-v", "--verbose",	parse_verbose,	0, 0 },
+	{ "-p", "--port", 	parse_lport, 	0, 0 },
+	{ "-l", "--listen", 	parse_laddr, 	0, 1 },
+	{ "-r", "--rtproto",	parse_rtproto,	0, 0 },
+	{ "-L", "--prefix-min",	parse_prefix_min, 0, 0 },
+	{ "-M", "--prefix-max",	parse_prefix_max, 0, 0 },
+	{ "-U", "--uplink",	parse_uplink,	0, 1 },
+	{ "-A", "--allow",	parse_allow,	0, 1 },
+	{ "-b", "--backlog",	parse_backlog,	0, 0 },
+	{ "-t", "--timeout",	parse_timeout,	0, 0 },
+	{ "-w", "--wait",	parse_wait,	0, 0 },
+	{ "-k", "--keepalive",	parse_keepalive, 0, 0 },
+	{ "-I", "--persist-idle", parse_persist_idle, 0, 0 },
+	{ "-Q", "--persist-max", parse_persist_max, 0, 0 },
+	{ "-O", "--unsent-max",	parse_unsent_max, 0, 0 },
+	{ "-n", "--no-strict",	parse_nostrict,	0, 0 },
+	{ "-u", "--udp",	parse_udp,	0, 0 },
+	{ "-m", "--metrics",	parse_metrics,	0, 0 },
+	{ "-S", "--shm",	parse_shm,	0, 0 },
+	{ "-R", "--record",	parse_record,	0, 0 },
+	{ "-P", "--replay",	parse_replay,	0, 0 },
+	{ "-T", "--threads",	parse_threads,	0, 0 },
+	{ "-C", "--cpu-steer",	parse_cpu_steer, 0, 0 },
+	{ "-i", "--idle-timeout", parse_idle,	0, 0 },
+	{ "-h", "--help", 	parse_help, 	0, 0 },
+	{ NULL, NULL, 		0, 		0, 0 }
 };
 
 /* Errors during argument parsing are sent to stderr; systemd should log them */
@@ -296,7 +735,7 @@ static void parse_args(int argc, char *argv[])
 			if (strcmp(argv[i], o->short_opt) == 0 ||
 					strcmp(argv[i], o->long_opt) == 0) {
 
-				if (!o->called) {
+				if (!o->called || o->repeatable) {
 					i += o->parse_fn(i, argc, argv);
 					o->called = 1;
 					break;
@@ -317,19 +756,67 @@ static void parse_args(int argc, char *argv[])
 		show_help(EXIT_FAILURE);
 	}
 
-	if (ip_version == AF_UNSPEC)
-		ip_version = AF_INET6;
+	if (prefix_min > prefix_max) {
+		fprintf(stderr, "%s: prefix length minimum (%" PRIu8 ") is "
+			"greater than maximum (%" PRIu8 ")\n", EXEC_NAME,
+			prefix_min, prefix_max);
+		show_help(EXIT_FAILURE);
+	}
+
+	if (num_laddrs == 0) {
+		/* INADDR_ANY is 0x00000000, so byte order doesn't matter */
+		laddrs[0].family = ipv4_only ? AF_INET : AF_INET6;
+		laddrs[0].in.s_addr = INADDR_ANY;
+		laddrs[0].in6 = in6addr_any;
+		num_laddrs = 1;
+	}
 
 	if (verbose) {
         	dbug("debug = %d\n", debug);
 	        dbug("verbose = %d\n", verbose);
         	dbug("lport = %" PRIu16 "\n", lport);
 		dbug("rtproto = %" PRIu8 "\n", rtproto);
-	        dbug("ip_version = %d\n", ip_version);
-        	dbug("laddr4 = %s\n",
-		     inet_ntop(AF_INET, &laddr4, buf, sizeof buf));
-	        dbug("laddr6 = %s\n",
-		     inet_ntop(AF_INET6, &laddr6, buf, sizeof buf));
+		dbug("prefix_min = %" PRIu8 "\n", prefix_min);
+		dbug("prefix_max = %" PRIu8 "\n", prefix_max);
+		for (i = 0; i < (int)num_uplinks; ++i) {
+			dbug("uplink = %s (table %" PRIu32 ")\n",
+			     uplinks[i].name, uplinks[i].table);
+		}
+		for (i = 0; i < (int)num_allows; ++i) {
+			dbug("allow = %s/%" PRIu8 "\n",
+			     inet_ntop(allows[i].family, allows[i].addr, buf,
+				       sizeof buf),
+			     allows[i].plen);
+		}
+		dbug("backlog = %d\n", backlog);
+		dbug("conn_timeout = %" PRId64 "\n", conn_timeout);
+		dbug("request_wait = %" PRId64 "\n", request_wait);
+		dbug("keepalive = %" PRId64 "\n", keepalive);
+		dbug("persist_idle = %" PRId64 "\n", persist_idle);
+		dbug("persist_max = %u\n", persist_max);
+		dbug("unsent_max = %zu\n", unsent_max);
+		dbug("strict_dump = %d\n", strict_dump);
+		dbug("udp = %d\n", udp);
+		dbug("metrics_path = %s\n",
+		     metrics_path != NULL ? metrics_path : "(none)");
+		dbug("shm_path = %s\n", shm_path != NULL ? shm_path : "(none)");
+		dbug("record_path = %s\n",
+		     record_path != NULL ? record_path : "(none)");
+		dbug("replay_path = %s\n",
+		     replay_path != NULL ? replay_path : "(none)");
+		dbug("num_workers = %u\n", num_workers);
+		dbug("cpu_steer = %d\n", cpu_steer);
+		dbug("idle_timeout = %" PRId64 "\n", idle_timeout);
+		dbug("ipv4_only = %d\n", ipv4_only);
+		dbug("v6only = %d\n", v6only);
+		for (i = 0; i < (int)num_laddrs; ++i) {
+			dbug("laddr = %s\n",
+			     laddrs[i].family == AF_INET
+				? inet_ntop(AF_INET, &laddrs[i].in, buf,
+					    sizeof buf)
+				: inet_ntop(AF_INET6, &laddrs[i].in6, buf,
+					    sizeof buf));
+		}
 	}
 }
 
@@ -337,360 +824,4846 @@ static void parse_args(int argc, char *argv[])
  *	Output buffer
  */
 
-static char outbuf[OUTBUF_SIZE];
-static int cursor = 0;
-
-__attribute__((format(printf, 1, 2)))
-static int bprintf(const char *fmt, ...)
-{
-	va_list ap;
-	int ret;
-
-	if (cursor >= (int)(sizeof outbuf) - 1)
-		return 1;
-
-	va_start(ap, fmt);
-	ret = vsnprintf(outbuf + cursor, sizeof outbuf - cursor, fmt, ap);
-	va_end(ap);
-
-	if (ret < 0) {
-		error("vsnprintf: %m\n");
-		abort();
-	}
-
-	if (ret >= (int)(sizeof outbuf) - cursor - 1) {
-		cursor = sizeof outbuf - 1;
-		return 1;
-	}
-	else {
-		cursor += ret;
-		return 0;
-	}
-}
-
-/*
- *	Main loop
- */
+#define OUTBUF_INITIAL	1024
 
-union sockaddr_inX {
-	struct sockaddr a;
-	struct sockaddr_in in;
-	struct sockaddr_in6 in6;
+struct buffer {
+	char *data;
+	size_t size;
+	size_t len;
 };
 
-static void get_ips(void)
+static void breset(struct buffer *const b)
 {
-	char addrbuf[INET6_ADDRSTRLEN];
-	struct ifaddrs *ifa, *ifaddrs;
-	sa_family_t family;
-	void *inX_addr;
-	int truncated;
-
-        if (getifaddrs(&ifaddrs) < 0) {
-                error("getifaddrs: %m\n");
-                exit(EXIT_FAILURE);
-        }
-
-        truncated = 0;
-
-        for (ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
-
-                if (ifa->ifa_addr == NULL) {
-                        warn("NULL address on interface %s\n",
-                             ifa->ifa_name);
-                        continue;
-                }
-
-                family = ifa->ifa_addr->sa_family;
-
-                if (family == AF_INET) {
-                        inX_addr = &((struct sockaddr_in *)
-                                                ifa->ifa_addr)->sin_addr;
-                }
-                else if (family == AF_INET6) {
-                        inX_addr = &((struct sockaddr_in6 *)
-                                                ifa->ifa_addr)->sin6_addr;
-                }
-                else if (family == AF_PACKET) {
-                        continue;
-                }
-                else {
-                        warn("Unknown address family (%u) on interface %s\n",
-                             family, ifa->ifa_name);
-                        continue;
-                }
-
-                if (inet_ntop(family, inX_addr, addrbuf,
-                                                sizeof addrbuf) == NULL) {
-                        error("inet_ntop: %m\n");
-                        abort();
-                }
-
-                truncated = bprintf("%s %s\n", ifa->ifa_name, addrbuf);
-        }
+	b->len = 0;
 
-	freeifaddrs(ifaddrs);
-
-        if (truncated)
-                warn("Output truncated\n");
+	if (b->data == NULL) {
+		b->size = OUTBUF_INITIAL;
+		if ((b->data = malloc(b->size)) == NULL) {
+			error("malloc: %m\n");
+			abort();
+		}
+	}
 }
 
-struct prefix { const struct in6_addr *dst; uint8_t len; };
-
-static int attr_cb(const struct nlattr *const attr, void *const data)
+static void bgrow(struct buffer *const b, const size_t needed)
 {
-	const struct in6_addr **const addr = data;
+	if (b->size - b->len >= needed)
+		return;
 
-	if (mnl_attr_get_type(attr) != RTA_DST)
-		return MNL_CB_OK;
+	do
+		b->size *= 2;
+	while (b->size - b->len < needed);
 
-	if (mnl_attr_validate2(attr, MNL_TYPE_BINARY, sizeof **addr) < 0) {
-		error("mnl_attr_validate2: %m\n");
+	if ((b->data = realloc(b->data, b->size)) == NULL) {
+		error("realloc: %m\n");
 		abort();
 	}
-
-	*addr = mnl_attr_get_payload(attr);
-
-	return MNL_CB_STOP;
 }
 
-static int msg_cb(const struct nlmsghdr *const nlh, void *const data)
+/* The buffer grows as needed, so output is never truncated */
+__attribute__((format(printf, 2, 3)))
+static void bprintf(struct buffer *const b, const char *fmt, ...)
 {
-	struct prefix *const prefix = data;
-	const struct rtmsg *rm;
-	struct in6_addr *addr;
+	va_list ap;
+	int ret;
 
-	rm = mnl_nlmsg_get_payload(nlh);
+	while (1) {
 
-	if (rm->rtm_protocol != rtproto)
-		return MNL_CB_OK;
+		va_start(ap, fmt);
+		ret = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
 
-	addr = NULL;
+		if (ret < 0) {
+			error("vsnprintf: %m\n");
+			abort();
+		}
+
+		if ((size_t)ret < b->size - b->len) {
+			b->len += ret;
+			return;
+		}
+
+		bgrow(b, ret + 1);
+	}
+}
+
+static void bput(struct buffer *const b, const void *const data,
+		 const size_t len)
+{
+	bgrow(b, len);
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+/*
+ *	Metrics
+ *
+ *	Counters and log2 histograms, exposed in Prometheus text format on an
+ *	optional Unix socket (see Metrics socket).  Each worker thread has its
+ *	own (thread-local) set, so updating one is still a plain increment;
+ *	they're added up when the metrics are rendered.
+ */
+
+enum counter {
+	M_ACCEPTED,
+	M_LEGACY,
+	M_FRAMED,
+	M_SUBSCRIBED,
+	M_PERSISTED,
+	M_REJECTED,
+	M_DROPPED,
+	M_UNSENT_DROPPED,
+	M_TIMEOUTS,
+	M_SEND_ERRORS,
+	M_UDP_QUERIES,
+	M_UDP_TOOBIG,
+	M_UDP_REJECTED,
+	M_UDP_UNPADDED,
+	M_NOT_MODIFIED,
+	M_NL_NOTIFY_BYTES,
+	M_RESYNCS,
+	M_NL_OVERFLOWS,
+	M_RESPONSE_CHANGES,
+	M_COUNT
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} counter_info[M_COUNT] = {
+	[M_ACCEPTED]		= { "connections_accepted",
+				    "TCP connections accepted" },
+	[M_LEGACY]		= { "responses_legacy",
+				    "Unframed responses (no request)" },
+	[M_FRAMED]		= { "responses_framed",
+				    "Framed responses to requests" },
+	[M_SUBSCRIBED]		= { "subscriptions",
+				    "Subscription requests" },
+	[M_PERSISTED]		= { "requests_persistent",
+				    "Requests after the first on a persistent "
+				    "connection" },
+	[M_REJECTED]		= { "requests_rejected",
+				    "TCP requests answered with ERROR" },
+	[M_DROPPED]		= { "connections_dropped",
+				    "Connections dropped with unsent data "
+				    "queued" },
+	[M_UNSENT_DROPPED]	= { "connections_dropped_unsent",
+				    "Connections dropped because their "
+				    "unsent data exceeded -O|--unsent-max" },
+	[M_TIMEOUTS]		= { "connections_timed_out",
+				    "Connections closed by a timeout" },
+	[M_SEND_ERRORS]		= { "send_errors",
+				    "Connections closed by a send error" },
+	[M_UDP_QUERIES]		= { "udp_queries",
+				    "UDP queries received" },
+	[M_UDP_TOOBIG]		= { "udp_toobig",
+				    "UDP queries answered with TOOBIG" },
+	[M_UDP_REJECTED]	= { "udp_rejected",
+				    "UDP queries answered with ERROR or "
+				    "ignored" },
+	[M_UDP_UNPADDED]	= { "udp_unpadded",
+				    "UDP queries ignored because the reply "
+				    "would have been bigger" },
+	[M_NOT_MODIFIED]	= { "responses_not_modified",
+				    "Conditional requests (TCP or UDP) "
+				    "answered with NOTMOD" },
+	[M_NL_NOTIFY_BYTES]	= { "netlink_notification_bytes",
+				    "Netlink notification bytes received" },
+	[M_RESYNCS]		= { "cache_resyncs",
+				    "Netlink cache rebuilds" },
+	[M_NL_OVERFLOWS]	= { "netlink_overflows",
+				    "Netlink notifications lost (ENOBUFS), "
+				    "forcing a rebuild" },
+	[M_RESPONSE_CHANGES]	= { "response_changes",
+				    "Times the response has changed" },
+};
+
+static __thread uint64_t counters[M_COUNT];
+
+/*
+ * Bucket i counts values in (2^(i-1), 2^i] units (bucket 0 is [0, 1]);
+ * larger values are only included in the +Inf bucket.  Times are measured in
+ * microseconds and exposed in seconds.
+ */
+#define HIST_BUCKETS		25
+
+enum histogram {
+	H_RESYNC,
+	H_DUMP_BYTES,
+	H_UPDATE,
+	H_RENDER,
+	H_SEND,
+	H_RESPONSE,
+	H_COUNT
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+	_Bool usecs;
+} histogram_info[H_COUNT] = {
+	[H_RESYNC]	= { "netlink_dump_seconds",
+			    "Time to rebuild the cache with netlink dumps", 1 },
+	[H_DUMP_BYTES]	= { "netlink_dump_bytes",
+			    "Size of the netlink dumps for a rebuild", 0 },
+	[H_UPDATE]	= { "netlink_update_seconds",
+			    "Time to process a batch of notifications", 1 },
+	[H_RENDER]	= { "render_seconds",
+			    "Time to render the response in every format", 1 },
+	[H_SEND]	= { "send_seconds",
+			    "Time spent in each sendmsg() call", 1 },
+	[H_RESPONSE]	= { "response_seconds",
+			    "Time from accept to the last byte of a "
+			    "response", 1 },
+};
+
+struct hist {
+	uint64_t buckets[HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+};
+
+static __thread struct hist histograms[H_COUNT];
+
+static void observe(const enum histogram h, const int64_t value)
+{
+	unsigned i;
+
+	if (value <= 1)
+		i = 0;
+	else
+		i = 64 - __builtin_clzll((uint64_t)value - 1);
+
+	if (i < HIST_BUCKETS)
+		++histograms[h].buckets[i];
+
+	++histograms[h].count;
+	histograms[h].sum += value > 0 ? value : 0;
+}
+
+/*
+ *	Workers
+ *
+ *	With -T|--threads, connections and UDP queries are handled by that many
+ *	worker threads, each with its own epoll instance and listening sockets,
+ *	bound to the same address with SO_REUSEPORT so that the kernel spreads
+ *	the load across them.  Everything a worker touches while serving
+ *	clients is thread-local, except for the snapshots and the cache.  The
+ *	main thread is worker 0; it alone keeps the cache up to date and
+ *	renders the response, which the others share (see Response).
+ *
+ *	With -C|--cpu-steer, a socket filter picks the worker by the CPU that
+ *	received the packet (CPU modulo the number of workers), and each worker
+ *	is pinned to the CPUs that it's picked for.
+ */
+
+struct worker {
+	pthread_t thread;
+	int *listen_fds;	/* one per listen address (or inherited) */
+	int *udp_fds;
+	int notify_fd;		/* eventfd, written when the response changes */
+	/* The worker's thread-local metrics, published once it has started */
+	const uint64_t *counters;
+	const struct hist *histograms;
+	const unsigned *conn_count;
+	const unsigned *subscribers;
+};
+
+static struct worker *workers = NULL;
+
+/* Is this thread worker 0? */
+static __thread _Bool main_thread = 0;
+
+/* The number of TCP and UDP sockets that each worker has */
+static unsigned num_tcp_fds = 0;
+static unsigned num_udp_fds = 0;
+
+/*
+ *	Address & route cache
+ *
+ *	Interfaces, addresses and candidate prefix routes are dumped once at
+ *	startup and then kept up to date from rtnetlink multicast events, so
+ *	answering a client never requires a kernel dump.
+ */
+
+union sockaddr_inX {
+	struct sockaddr a;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+};
+
+union inX_addr {
+	struct in_addr in;
+	struct in6_addr in6;
+};
+
+struct iface {
+	int index;
+	char name[IF_NAMESIZE];
+};
+
+/* The kernel's INFINITY_LIFE_TIME, also used for absolute times */
+#define LIFETIME_INFINITE	UINT32_MAX
+
+struct address {
+	union inX_addr addr;
+	int ifindex;
+	sa_family_t family;
+	uint8_t prefixlen;
+	uint32_t flags;			/* IFA_F_* */
+	uint32_t preferred;		/* Unix time (see lifetime_expiry) */
+	uint32_t valid;			/* Unix time (see lifetime_expiry) */
+	char label[IF_NAMESIZE];	/* IPv4 only; empty for IPv6 */
+};
+
+struct route {
+	struct in6_addr dst;
+	uint32_t table;
+	uint32_t priority;
+	uint32_t expires;		/* Unix time (see lifetime_expiry) */
+	const char *uplink;		/* NULL if untagged */
+	uint8_t len;
+};
+
+struct cache {
+	struct iface *ifaces;
+	size_t num_ifaces;
+	size_t max_ifaces;
+	struct address *addrs;
+	size_t num_addrs;
+	size_t max_addrs;
+	struct route *routes;
+	size_t num_routes;
+	size_t max_routes;
+};
+
+static struct cache cache = { 0 };
+
+static struct mnl_socket *mnl;
+
+/* Does the kernel support (and check) filtered dump requests? */
+static _Bool strict_chk = 0;
+
+/* Set if the kernel reports that a dump was inconsistent */
+static _Bool dump_intr = 0;
+
+/*
+ * Only the main thread changes the cache, but the other workers read it to
+ * render filtered responses (see get_response).  The main thread re-renders
+ * its own responses before it lets them in again (see update_response), so
+ * the generation of those responses always matches the cache.
+ */
+static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint64_t cache_generation = 0;
+
+/* Big enough for the kernel's largest multi-part dump messages */
+#ifndef MNL_SOCKET_DUMP_SIZE
+#define MNL_SOCKET_DUMP_SIZE	32768
+#endif
+#define NL_BUFSIZE		MNL_SOCKET_DUMP_SIZE
+
+static void *grow(void *const array, size_t *const max, const size_t count,
+		  const size_t size)
+{
+	void *new;
+
+	if (count < *max)
+		return array;
+
+	*max = *max ? *max * 2 : 16;
+
+	if ((new = realloc(array, *max * size)) == NULL) {
+		error("realloc: %m\n");
+		abort();
+	}
+
+	return new;
+}
+
+static void cache_clear(void)
+{
+	cache.num_ifaces = 0;
+	cache.num_addrs = 0;
+	cache.num_routes = 0;
+}
+
+static struct iface *cache_find_iface(const int index)
+{
+	size_t i;
+
+	for (i = 0; i < cache.num_ifaces; ++i) {
+		if (cache.ifaces[i].index == index)
+			return &cache.ifaces[i];
+	}
+
+	return NULL;
+}
+
+static const char *cache_ifname(const struct address *const addr)
+{
+	const struct iface *iface;
+
+	if (addr->label[0] != 0)
+		return addr->label;
+
+	if ((iface = cache_find_iface(addr->ifindex)) == NULL)
+		return "?";
+
+	return iface->name;
+}
+
+static struct address *cache_find_addr(const struct address *const key)
+{
+	struct address *addr;
+	size_t i;
+
+	for (i = 0; i < cache.num_addrs; ++i) {
+
+		addr = &cache.addrs[i];
+
+		if (addr->ifindex == key->ifindex
+				&& addr->family == key->family
+				&& memcmp(&addr->addr, &key->addr,
+					  key->family == AF_INET
+						? sizeof key->addr.in
+						: sizeof key->addr.in6) == 0) {
+			return addr;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The candidate routes are kept sorted, so they're found by binary search
+ * (there may be a lot of delegations), and listed in a consistent order.
+ */
+static int route_cmp(const struct route *const a, const struct route *const b)
+{
+	int ret;
+
+	if ((ret = memcmp(&a->dst, &b->dst, sizeof a->dst)) != 0)
+		return ret;
+
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+
+	if (a->table != b->table)
+		return a->table < b->table ? -1 : 1;
+
+	if (a->priority != b->priority)
+		return a->priority < b->priority ? -1 : 1;
+
+	return 0;
+}
+
+/* Returns the index of the route, or where it would be inserted */
+static size_t cache_find_route(const struct route *const key,
+			       _Bool *const found)
+{
+	size_t lo, hi, mid;
+	int cmp;
+
+	lo = 0;
+	hi = cache.num_routes;
+
+	while (lo < hi) {
+
+		mid = lo + (hi - lo) / 2;
+		cmp = route_cmp(&cache.routes[mid], key);
+
+		if (cmp == 0) {
+			*found = 1;
+			return mid;
+		}
+
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*found = 0;
+	return lo;
+}
+
+/* Remove element i from an array, preserving the order of the others */
+static void cache_remove(void *const array, size_t *const count,
+			 const size_t i, const size_t size)
+{
+	char *const a = array;
+
+	memmove(a + i * size, a + (i + 1) * size, (*count - i - 1) * size);
+	--*count;
+}
+
+struct attrs {
+	const struct nlattr **tb;
+	uint16_t max;
+};
+
+static int attr_cb(const struct nlattr *const attr, void *const data)
+{
+	const struct attrs *const attrs = data;
+
+	if (mnl_attr_type_valid(attr, attrs->max) < 0)
+		return MNL_CB_OK;
+
+	attrs->tb[mnl_attr_get_type(attr)] = attr;
+
+	return MNL_CB_OK;
+}
+
+/*
+ * Returns 0 if the message is malformed.  That shouldn't happen, but a bad
+ * message is ignored rather than trusted (or fatal).
+ */
+static int parse_attrs(const struct nlmsghdr *const nlh, const size_t hdrlen,
+		       const struct nlattr **const tb, const uint16_t max)
+{
+	struct attrs attrs = { .tb = tb, .max = max };
+
+	memset(tb, 0, (max + 1) * sizeof *tb);
+
+	if (mnl_nlmsg_get_payload_len(nlh) < hdrlen) {
+		warn("Ignoring truncated netlink message\n");
+		return 0;
+	}
+
+	if (mnl_attr_parse(nlh, hdrlen, attr_cb, &attrs) < 0) {
+		warn("mnl_attr_parse: %m\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+static void link_cb(const struct nlmsghdr *const nlh)
+{
+	const struct nlattr *tb[IFLA_MAX + 1];
+	const struct ifinfomsg *ifm;
+	struct iface *iface;
+	size_t i;
+
+	if (!parse_attrs(nlh, sizeof *ifm, tb, IFLA_MAX))
+		return;
+
+	ifm = mnl_nlmsg_get_payload(nlh);
+	iface = cache_find_iface(ifm->ifi_index);
+
+	if (nlh->nlmsg_type == RTM_DELLINK) {
+
+		if (iface != NULL) {
+			cache_remove(cache.ifaces, &cache.num_ifaces,
+				     iface - cache.ifaces, sizeof *iface);
+		}
+
+		for (i = 0; i < cache.num_addrs; ) {
+			if (cache.addrs[i].ifindex == ifm->ifi_index) {
+				cache_remove(cache.addrs, &cache.num_addrs, i,
+					     sizeof *cache.addrs);
+			}
+			else {
+				++i;
+			}
+		}
+
+		return;
+	}
+
+	if (tb[IFLA_IFNAME] == NULL
+			|| mnl_attr_validate(tb[IFLA_IFNAME],
+					     MNL_TYPE_NUL_STRING) < 0) {
+		warn("Ignoring link %d with no valid name\n", ifm->ifi_index);
+		return;
+	}
+
+	if (iface == NULL) {
+		cache.ifaces = grow(cache.ifaces, &cache.max_ifaces,
+				    cache.num_ifaces, sizeof *cache.ifaces);
+		iface = &cache.ifaces[cache.num_ifaces++];
+		iface->index = ifm->ifi_index;
+	}
+
+	strncpy(iface->name, mnl_attr_get_str(tb[IFLA_IFNAME]),
+		sizeof iface->name - 1);
+	iface->name[sizeof iface->name - 1] = 0;
+}
+
+/* When the message being parsed was sent (or saved; see Restarts) */
+static time_t restored_at = 0;
+
+static time_t cache_time(void)
+{
+	return restored_at != 0 ? restored_at : time(NULL);
+}
+
+/*
+ * The kernel reports the time left, in whole seconds, so dumps a second apart
+ * can round the same expiry differently.  That isn't a change.  Nor is the
+ * time of an expiry that has passed (when there's none left), so that's 0.
+ */
+static uint32_t lifetime_expiry(const uint32_t left, const uint32_t old,
+				const time_t now)
+{
+	int64_t expiry;
+
+	if (left == LIFETIME_INFINITE)
+		return LIFETIME_INFINITE;
+
+	if (left == 0)
+		return 0;
+
+	expiry = (int64_t)now + left;
+	if (expiry >= LIFETIME_INFINITE)
+		return LIFETIME_INFINITE;
+
+	if (old != LIFETIME_INFINITE && expiry - old >= -1 && expiry - old <= 1)
+		return old;
+
+	return (uint32_t)expiry;
+}
+
+static void addr_cb(const struct nlmsghdr *const nlh)
+{
+	const struct nlattr *tb[IFA_MAX + 1];
+	const struct ifa_cacheinfo *ci;
+	const struct ifaddrmsg *ifa;
+	const struct nlattr *attr;
+	struct address key, *addr;
+	size_t addrlen;
+	time_t now;
+
+	if (!parse_attrs(nlh, sizeof *ifa, tb, IFA_MAX))
+		return;
+
+	ifa = mnl_nlmsg_get_payload(nlh);
+
+	if (ifa->ifa_family == AF_INET)
+		addrlen = sizeof key.addr.in;
+	else if (ifa->ifa_family == AF_INET6)
+		addrlen = sizeof key.addr.in6;
+	else
+		return;
+
+	/* Same preference as getifaddrs(3) */
+	if ((attr = tb[IFA_LOCAL]) == NULL && (attr = tb[IFA_ADDRESS]) == NULL)
+		return;
+
+	if (mnl_attr_validate2(attr, MNL_TYPE_BINARY, addrlen) < 0) {
+		warn("Ignoring address with invalid length\n");
+		return;
+	}
+
+	memset(&key, 0, sizeof key);
+	key.ifindex = ifa->ifa_index;
+	key.family = ifa->ifa_family;
+	memcpy(&key.addr, mnl_attr_get_payload(attr), addrlen);
+
+	addr = cache_find_addr(&key);
+
+	if (nlh->nlmsg_type == RTM_DELADDR) {
+		if (addr != NULL) {
+			cache_remove(cache.addrs, &cache.num_addrs,
+				     addr - cache.addrs, sizeof *addr);
+		}
+		return;
+	}
+
+	if (addr == NULL) {
+		cache.addrs = grow(cache.addrs, &cache.max_addrs,
+				   cache.num_addrs, sizeof *cache.addrs);
+		addr = &cache.addrs[cache.num_addrs++];
+		*addr = key;
+	}
+
+	addr->prefixlen = ifa->ifa_prefixlen;
+
+	/* IFA_FLAGS has the flags that don't fit in ifa_flags */
+	addr->flags = ifa->ifa_flags;
+	if (tb[IFA_FLAGS] != NULL
+			&& mnl_attr_validate(tb[IFA_FLAGS], MNL_TYPE_U32) == 0)
+		addr->flags = mnl_attr_get_u32(tb[IFA_FLAGS]);
+
+	if (tb[IFA_CACHEINFO] != NULL
+			&& mnl_attr_validate2(tb[IFA_CACHEINFO], MNL_TYPE_BINARY,
+					      sizeof *ci) == 0) {
+		ci = mnl_attr_get_payload(tb[IFA_CACHEINFO]);
+		now = cache_time();
+		addr->preferred = lifetime_expiry(ci->ifa_prefered,
+						  addr->preferred, now);
+		addr->valid = lifetime_expiry(ci->ifa_valid, addr->valid, now);
+	}
+	else {
+		addr->preferred = LIFETIME_INFINITE;
+		addr->valid = LIFETIME_INFINITE;
+	}
+
+	/* getifaddrs(3) reports IPv4 addresses by label (e.g. eth0:1) */
+	if (ifa->ifa_family == AF_INET && tb[IFA_LABEL] != NULL
+			&& mnl_attr_validate(tb[IFA_LABEL],
+					     MNL_TYPE_NUL_STRING) == 0) {
+		strncpy(addr->label, mnl_attr_get_str(tb[IFA_LABEL]),
+			sizeof addr->label - 1);
+		addr->label[sizeof addr->label - 1] = 0;
+	}
+}
+
+static void route_cb(const struct nlmsghdr *const nlh)
+{
+	const struct nlattr *tb[RTA_MAX + 1];
+	const struct rta_cacheinfo *ci;
+	const struct rtmsg *rm;
+	struct route key, *route;
+	uint32_t left;
+	_Bool found;
+	unsigned u;
+	size_t i;
+
+	rm = mnl_nlmsg_get_payload(nlh);
+
+	/* Most routes are rejected here, without parsing their attributes */
+	if (mnl_nlmsg_get_payload_len(nlh) < sizeof *rm
+			|| rm->rtm_family != AF_INET6
+			|| rm->rtm_protocol != rtproto)
+		return;
+
+	if (!parse_attrs(nlh, sizeof *rm, tb, RTA_MAX))
+		return;
+
+	if (tb[RTA_DST] == NULL) {
+		warn("Ignoring route with no destination\n");
+		return;
+	}
+
+	if (mnl_attr_validate2(tb[RTA_DST], MNL_TYPE_BINARY,
+			       sizeof key.dst) < 0) {
+		warn("Ignoring route with invalid destination\n");
+		return;
+	}
+
+	if (rm->rtm_dst_len < prefix_min || rm->rtm_dst_len > prefix_max) {
+		warn("Ignoring route with unsupported prefix length "
+		      "(%" PRIu8 ")\n", rm->rtm_dst_len);
+		return;
+	}
+
+	memset(&key, 0, sizeof key);
+	memcpy(&key.dst, mnl_attr_get_payload(tb[RTA_DST]), sizeof key.dst);
+	key.len = rm->rtm_dst_len;
+	key.table = rm->rtm_table;
+	if (tb[RTA_TABLE] != NULL
+			&& mnl_attr_validate(tb[RTA_TABLE], MNL_TYPE_U32) == 0)
+		key.table = mnl_attr_get_u32(tb[RTA_TABLE]);
+	if (tb[RTA_PRIORITY] != NULL
+			&& mnl_attr_validate(tb[RTA_PRIORITY], MNL_TYPE_U32) == 0)
+		key.priority = mnl_attr_get_u32(tb[RTA_PRIORITY]);
+
+	i = cache_find_route(&key, &found);
+
+	if (nlh->nlmsg_type == RTM_DELROUTE) {
+		if (found) {
+			cache_remove(cache.routes, &cache.num_routes, i,
+				     sizeof *cache.routes);
+		}
+		return;
+	}
+
+	if (!found) {
+
+		for (u = 0; u < num_uplinks; ++u) {
+			if (uplinks[u].table == key.table) {
+				key.uplink = uplinks[u].name;
+				break;
+			}
+		}
+
+		cache.routes = grow(cache.routes, &cache.max_routes,
+				    cache.num_routes, sizeof *cache.routes);
+		memmove(&cache.routes[i + 1], &cache.routes[i],
+			(cache.num_routes - i) * sizeof *cache.routes);
+		cache.routes[i] = key;
+		++cache.num_routes;
+	}
+
+	route = &cache.routes[i];
+
+	/* Set with "expires" (in USER_HZ ticks; 0 if it doesn't expire) */
+	left = LIFETIME_INFINITE;
+	if (tb[RTA_CACHEINFO] != NULL
+			&& mnl_attr_validate2(tb[RTA_CACHEINFO], MNL_TYPE_BINARY,
+					      sizeof *ci) == 0) {
+		ci = mnl_attr_get_payload(tb[RTA_CACHEINFO]);
+		if (ci->rta_expires < 0)
+			left = 0;
+		else if (ci->rta_expires > 0)
+			left = ci->rta_expires / sysconf(_SC_CLK_TCK);
+	}
+
+	route->expires = lifetime_expiry(left, route->expires, cache_time());
+}
+
+/* Handles dump responses and multicast notifications alike */
+static int msg_cb(const struct nlmsghdr *const nlh,
+		  void *const data __attribute__((unused)))
+{
+	switch (nlh->nlmsg_type) {
+
+		case RTM_NEWLINK:
+		case RTM_DELLINK:
+			link_cb(nlh);
+			break;
+
+		case RTM_NEWADDR:
+		case RTM_DELADDR:
+			addr_cb(nlh);
+			break;
+
+		case RTM_NEWROUTE:
+		case RTM_DELROUTE:
+			route_cb(nlh);
+			break;
+	}
+
+	return MNL_CB_OK;
+}
+
+/*
+ * Netlink captures
+ *
+ * With -R|--record, the raw dump buffers received while building the cache
+ * are saved to a file, which can later be fed through the same callbacks
+ * with -P|--replay (without root or a live routing table), or used by the
+ * parser benchmark and fuzz target.  The file starts with CAPTURE_MAGIC,
+ * followed by records consisting of a length (uint32_t, host byte order, like
+ * netlink itself) and that many bytes of netlink messages.
+ */
+
+#define CAPTURE_MAGIC		"DENATNL1"
+
+struct capture {
+	uint8_t *data;
+	size_t len;
+};
+
+static int record_fd = -1;
+
+static void write_all(const int fd, const void *const buf, const size_t len,
+		      const char *const name)
+{
+	size_t done;
+	ssize_t ret;
+
+	for (done = 0; done < len; done += ret) {
+		ret = write(fd, (const uint8_t *)buf + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			error("write: %s: %m\n", name);
+			abort();
+		}
+	}
+}
+
+static void capture_open(void)
+{
+	record_fd = open(record_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			 0644);
+	if (record_fd < 0) {
+		error("open: %s: %m\n", record_path);
+		abort();
+	}
+
+	write_all(record_fd, CAPTURE_MAGIC, sizeof CAPTURE_MAGIC - 1,
+		  record_path);
+}
+
+static void capture_write(const void *const buf, const size_t len)
+{
+	uint32_t len32 = len;
+
+	if (record_fd < 0)
+		return;
+
+	write_all(record_fd, &len32, sizeof len32, record_path);
+	write_all(record_fd, buf, len, record_path);
+}
+
+/* Reads an entire file (from the start) into memory */
+static void read_all(const int fd, const char *const name,
+		     struct capture *const cap)
+{
+	struct stat st;
+	size_t done;
+	ssize_t ret;
+
+	if (fstat(fd, &st) < 0) {
+		error("fstat: %s: %m\n", name);
+		abort();
+	}
+
+	cap->len = st.st_size;
+	if ((cap->data = malloc(cap->len + 1)) == NULL) {
+		error("malloc: %m\n");
+		abort();
+	}
+
+	for (done = 0; done < cap->len; done += ret) {
+		ret = pread(fd, cap->data + done, cap->len - done, done);
+		if (ret <= 0) {
+			error("read: %s: %m\n", name);
+			abort();
+		}
+	}
+}
+
+static _Bool is_capture(const struct capture *const cap)
+{
+	return cap->len >= sizeof CAPTURE_MAGIC - 1
+		&& memcmp(cap->data, CAPTURE_MAGIC,
+			  sizeof CAPTURE_MAGIC - 1) == 0;
+}
+
+static void capture_load(const char *const path, struct capture *const cap)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		error("%s: %m\n", path);
+		abort();
+	}
+
+	read_all(fd, path, cap);
+	close(fd);
+
+	if (!is_capture(cap)) {
+		error("%s: not a netlink capture\n", path);
+		abort();
+	}
+}
+
+/*
+ * Returns the next buffer (and its length) from a capture, or NULL at the
+ * end.  *offset should be 0 to start with.
+ */
+static const uint8_t *capture_next(const struct capture *const cap,
+				   size_t *const offset, size_t *const len)
+{
+	uint32_t len32;
+	size_t off;
+
+	off = *offset == 0 ? sizeof CAPTURE_MAGIC - 1 : *offset;
+
+	if (cap->len - off < sizeof len32)
+		return NULL;
+
+	memcpy(&len32, cap->data + off, sizeof len32);
+	off += sizeof len32;
+
+	if (cap->len - off < len32) {
+		warn("Truncated capture record\n");
+		return NULL;
+	}
+
+	*offset = off + len32;
+	*len = len32;
+
+	return cap->data + off;
+}
+
+/*
+ *	Restarts
+ *
+ *	On SIGHUP, denatd re-executes itself -- the same path and arguments,
+ *	so an upgraded binary takes over -- without closing its listening
+ *	sockets.  Each worker stops accepting connections and reading UDP
+ *	queries, closes its subscriptions (subscribers reconnect), and finishes
+ *	the responses that it has started; clients that arrive meanwhile are
+ *	queued by the kernel for the new image.  The listening sockets are
+ *	passed the way systemd passes them (see Socket activation), along with
+ *	the netlink socket, so no notifications are lost, and a memfd holding
+ *	the restart state: a header, followed by the cache serialized as a
+ *	capture of synthesized netlink messages.  The new image loads the
+ *	cache, applies the notifications queued since it was saved, and is
+ *	ready to answer without a kernel dump.
+ *
+ *	SIGUSR2 does the same, except that the new image dumps the cache
+ *	afresh.  So does a new image with a different routing protocol.
+ *	Inherited sockets are used as they are (and shared by the workers), so
+ *	changes to -l, -p, -4 or -u need a full restart.
+ */
+
+#define STATE_MAGIC		"DENATST2"
+
+struct state {
+	char magic[sizeof STATE_MAGIC - 1];
+	uint64_t generation;
+	int64_t saved;		/* lifetimes in the cache are relative to this */
+	int32_t netlink_fd;	/* -1 if the cache wasn't saved */
+	uint8_t rtproto;
+	_Bool activated;
+};
+
+/* The previous image's netlink socket and cache (see get_state) */
+static int restored_fd = -1;
+static struct capture restored = { 0 };
+
+static void save_flush(struct buffer *const b, const uint8_t *const msg,
+		       size_t *const used)
+{
+	uint32_t len32 = *used;
+
+	if (*used == 0)
+		return;
+
+	bput(b, &len32, sizeof len32);
+	bput(b, msg, *used);
+	*used = 0;
+}
+
+/* Starts a message, first flushing the buffer if it might not fit */
+static struct nlmsghdr *save_msg(struct buffer *const b, uint8_t *const msg,
+				 size_t *const used, const uint16_t type)
+{
+	struct nlmsghdr *nlh;
+
+	if (NL_BUFSIZE - *used < 256)
+		save_flush(b, msg, used);
+
+	nlh = mnl_nlmsg_put_header(msg + *used);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_MULTI;
+
+	return nlh;
+}
+
+/* Time left (see lifetime_expiry) */
+static uint32_t lifetime_left(const uint32_t expiry, const time_t now)
+{
+	if (expiry == LIFETIME_INFINITE)
+		return LIFETIME_INFINITE;
+
+	return expiry > now ? expiry - now : 0;
+}
+
+/* Appends the cache to b, as a capture that msg_cb can load */
+static void cache_save(struct buffer *const b, const time_t now)
+{
+	uint8_t msg[NL_BUFSIZE];
+	struct ifa_cacheinfo ifci;
+	struct rta_cacheinfo rtci;
+	const struct address *addr;
+	const struct route *route;
+	struct nlmsghdr *nlh;
+	struct ifinfomsg *ifi;
+	struct ifaddrmsg *ifa;
+	struct rtmsg *rtm;
+	size_t i, used;
+
+	bput(b, CAPTURE_MAGIC, sizeof CAPTURE_MAGIC - 1);
+	used = 0;
+
+	for (i = 0; i < cache.num_ifaces; ++i) {
+		nlh = save_msg(b, msg, &used, RTM_NEWLINK);
+		ifi = mnl_nlmsg_put_extra_header(nlh, sizeof *ifi);
+		ifi->ifi_index = cache.ifaces[i].index;
+		mnl_attr_put_strz(nlh, IFLA_IFNAME, cache.ifaces[i].name);
+		used += nlh->nlmsg_len;
+	}
+
+	for (i = 0; i < cache.num_addrs; ++i) {
+		addr = &cache.addrs[i];
+		nlh = save_msg(b, msg, &used, RTM_NEWADDR);
+		ifa = mnl_nlmsg_put_extra_header(nlh, sizeof *ifa);
+		ifa->ifa_family = addr->family;
+		ifa->ifa_prefixlen = addr->prefixlen;
+		ifa->ifa_index = addr->ifindex;
+		mnl_attr_put(nlh, IFA_LOCAL, addr->family == AF_INET
+						? sizeof addr->addr.in
+						: sizeof addr->addr.in6,
+			     &addr->addr);
+		if (addr->label[0] != 0)
+			mnl_attr_put_strz(nlh, IFA_LABEL, addr->label);
+		mnl_attr_put_u32(nlh, IFA_FLAGS, addr->flags);
+		memset(&ifci, 0, sizeof ifci);
+		ifci.ifa_prefered = lifetime_left(addr->preferred, now);
+		ifci.ifa_valid = lifetime_left(addr->valid, now);
+		mnl_attr_put(nlh, IFA_CACHEINFO, sizeof ifci, &ifci);
+		used += nlh->nlmsg_len;
+	}
+
+	for (i = 0; i < cache.num_routes; ++i) {
+		route = &cache.routes[i];
+		nlh = save_msg(b, msg, &used, RTM_NEWROUTE);
+		rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
+		rtm->rtm_family = AF_INET6;
+		rtm->rtm_dst_len = route->len;
+		rtm->rtm_protocol = rtproto;
+		rtm->rtm_table = route->table < 256 ? route->table
+						    : RT_TABLE_COMPAT;
+		mnl_attr_put(nlh, RTA_DST, sizeof route->dst, &route->dst);
+		mnl_attr_put_u32(nlh, RTA_TABLE, route->table);
+		mnl_attr_put_u32(nlh, RTA_PRIORITY, route->priority);
+		if (route->expires != LIFETIME_INFINITE) {
+			memset(&rtci, 0, sizeof rtci);
+			rtci.rta_expires = lifetime_left(route->expires, now)
+						* sysconf(_SC_CLK_TCK);
+			if (rtci.rta_expires == 0)
+				rtci.rta_expires = -1;
+			mnl_attr_put(nlh, RTA_CACHEINFO, sizeof rtci, &rtci);
+		}
+		used += nlh->nlmsg_len;
+	}
+
+	save_flush(b, msg, &used);
+}
+
+static void cache_restore(void)
+{
+	const uint8_t *buf;
+	size_t offset, len;
+
+	cache_clear();
+
+	for (offset = 0; (buf = capture_next(&restored, &offset, &len))
+								!= NULL; ) {
+		if (mnl_cb_run(buf, len, 0, 0, msg_cb, NULL) < 0) {
+			error("mnl_cb_run: %m\n");
+			abort();
+		}
+	}
+
+	restored_at = 0;
+	free(restored.data);
+	restored.data = NULL;
+
+	dbug("Cache restored: %zu interfaces, %zu addresses, %zu routes\n",
+	     cache.num_ifaces, cache.num_addrs, cache.num_routes);
+}
+
+/* Checks whether a received buffer ends the dump */
+static _Bool dump_done(const uint8_t *const buf, const size_t len)
+{
+	const struct nlmsghdr *nlh;
+	int left;
+
+	left = len;
+
+	for (nlh = (const struct nlmsghdr *)buf; mnl_nlmsg_ok(nlh, left);
+					nlh = mnl_nlmsg_next(nlh, &left)) {
+		if (nlh->nlmsg_type == NLMSG_DONE
+				|| nlh->nlmsg_type == NLMSG_ERROR)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Notifications that arrive during the dump are processed in order with the
+ * dump responses.  Notifications carry the portid and sequence number of the
+ * process that made the change, so sequence/portid checking is disabled.
+ *
+ * With strict checking, the kernel requires the full header for each type of
+ * dump, and treats its non-zero fields as filters.  On a router with a full
+ * routing table, filtering by protocol means that only the candidate routes
+ * are copied out of the kernel.  (Older kernels ignore the filter, so
+ * route_cb always checks the protocol.)
+ */
+/* Returns the number of bytes received */
+static size_t cache_dump(const uint16_t type, const uint8_t family)
+{
+	uint8_t msg[NL_BUFSIZE];
+	struct nlmsghdr *nlh;
+	struct ifinfomsg *ifi;
+	struct ifaddrmsg *ifa;
+	struct rtmsg *rtm;
+	size_t total, len;
+	ssize_t ret;
+	time_t seq;
+
+	total = 0;
+	nlh = mnl_nlmsg_put_header(msg);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_seq = time(&seq);
+
+	switch (type) {
+
+		case RTM_GETLINK:
+			ifi = mnl_nlmsg_put_extra_header(nlh, sizeof *ifi);
+			ifi->ifi_family = family;
+			break;
+
+		case RTM_GETADDR:
+			ifa = mnl_nlmsg_put_extra_header(nlh, sizeof *ifa);
+			ifa->ifa_family = family;
+			break;
+
+		case RTM_GETROUTE:
+			rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
+			rtm->rtm_family = family;
+			if (strict_chk && strict_dump)
+				rtm->rtm_protocol = rtproto;
+			break;
+	}
+
+	if (mnl_socket_sendto(mnl, nlh, nlh->nlmsg_len) < 0) {
+		error("mnl_socket_sendto: %m\n");
+		abort();
+	}
+
+	while (1) {
+
+		if ((ret = mnl_socket_recvfrom(mnl, msg, sizeof msg)) < 0) {
+
+			if (errno == EINTR)
+				continue;
+
+			/*
+			 * The socket is also subscribed to notifications, and a
+			 * burst of them has overflowed its buffer.  Some were
+			 * lost, so the cache can't be trusted; keep reading to
+			 * the end of the dump, which will be retried.
+			 */
+			if (errno == ENOBUFS) {
+				++counters[M_NL_OVERFLOWS];
+				dump_intr = 1;
+				continue;
+			}
+
+			error("mnl_socket_recvfrom: %m\n");
+			abort();
+		}
+
+		if (ret == 0)
+			break;
+
+		total += ret;
+		capture_write(msg, ret);
+
+		len = ret;
+		ret = mnl_cb_run(msg, len, 0, 0, msg_cb, NULL);
+
+		/*
+		 * libmnl stops at the first message flagged NLM_F_DUMP_INTR --
+		 * the object list changed during the dump, so it may be
+		 * incomplete.  Drain the rest of it; it will be retried.
+		 */
+		if (ret < 0 && errno == EINTR) {
+			dump_intr = 1;
+			ret = !dump_done(msg, len);
+		}
+		else if (ret < 0) {
+			error("mnl_cb_run: %m\n");
+			abort();
+		}
+
+		if (ret <= 0)
+			break;
+	}
+
+	return total;
+}
+
+/*
+ * Discard any queued notifications (which may be stale if some were dropped),
+ * then rebuild the cache from scratch.  Once there are workers, the caller
+ * holds cache_lock for writing.
+ */
+static void cache_resync(void)
+{
+	uint8_t msg[NL_BUFSIZE];
+	int64_t start;
+	size_t bytes;
+	int fd;
+
+	fd = mnl_socket_get_fd(mnl);
+	start = now_us();
+
+	while (1) {
+
+		while (recv(fd, msg, sizeof msg, MSG_DONTWAIT) >= 0
+				|| errno == EINTR || errno == ENOBUFS);
+
+		if (errno != EAGAIN) {
+			error("recv: %m\n");
+			abort();
+		}
+
+		dump_intr = 0;
+
+		cache_clear();
+		bytes = cache_dump(RTM_GETLINK, AF_UNSPEC);
+		bytes += cache_dump(RTM_GETADDR, AF_UNSPEC);
+		bytes += cache_dump(RTM_GETROUTE, AF_INET6);
+
+		if (!dump_intr)
+			break;
+
+		dbug("Dump interrupted by changes (or lost notifications); "
+		     "retrying\n");
+	}
+
+	++counters[M_RESYNCS];
+	observe(H_DUMP_BYTES, bytes);
+	observe(H_RESYNC, now_us() - start);
+
+	dbug("Cache: %zu interfaces, %zu addresses, %zu routes (%" PRId64
+	     " ms)\n", cache.num_ifaces, cache.num_addrs, cache.num_routes,
+	     (now_us() - start) / 1000);
+}
+
+/*
+ * Process all pending notifications.  Once there are workers, the caller
+ * holds cache_lock for writing, so they never see a partially applied batch.
+ */
+static void cache_update(void)
+{
+	uint8_t msg[NL_BUFSIZE];
+	int64_t start;
+	ssize_t ret;
+	int fd;
+
+	fd = mnl_socket_get_fd(mnl);
+	start = now_us();
+
+	while (1) {
+
+		ret = recv(fd, msg, sizeof msg, MSG_DONTWAIT);
+		if (ret < 0) {
+
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN) {
+				observe(H_UPDATE, now_us() - start);
+				return;
+			}
+
+			if (errno == ENOBUFS) {
+				++counters[M_NL_OVERFLOWS];
+				warn("Netlink notifications lost; "
+				     "rebuilding cache\n");
+				cache_resync();
+				return;
+			}
+
+			error("recv: %m\n");
+			abort();
+		}
+
+		counters[M_NL_NOTIFY_BYTES] += ret;
+
+		if (mnl_cb_run(msg, ret, 0, 0, msg_cb, NULL) < 0) {
+			error("mnl_cb_run: %m\n");
+			abort();
+		}
+	}
+}
+
+/*
+ * Route notifications can't be filtered by the kernel like dumps, so drop the
+ * ones for other protocols with a socket filter.  Everything else, including
+ * dump responses (NLM_F_MULTI), is accepted.  Netlink headers are in host
+ * byte order, but BPF loads are big-endian, hence the htons() calls.
+ */
+static void filter_notifications(const int fd)
+{
+	struct sock_filter code[] = {
+		/* nlmsg_type */
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_NEWROUTE), 1, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_DELROUTE), 0, 4),
+		/* nlmsg_flags */
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, htons(NLM_F_MULTI), 2, 0),
+		/* rtm_protocol */
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+			 NLMSG_HDRLEN + offsetof(struct rtmsg, rtm_protocol)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, rtproto, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof code / sizeof code[0],
+		.filter = code,
+	};
+
+	/* Failure just means more work for route_cb */
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		       sizeof prog) < 0) {
+		warn("setsockopt(SO_ATTACH_FILTER): %m\n");
+	}
+}
+
+static void get_netlink(void)
+{
+	static const unsigned groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR
+					| RTMGRP_IPV6_IFADDR
+					| RTMGRP_IPV6_ROUTE;
+	static const int rcvbuf = 1024 * 1024;
+	static const int one = 1;
+	int fd;
+
+	if (restored_fd >= 0) {
+		if ((mnl = mnl_socket_fdopen(restored_fd)) == NULL
+				|| fcntl(restored_fd, F_SETFD, FD_CLOEXEC) < 0) {
+			error("mnl_socket_fdopen: %m\n");
+			abort();
+		}
+	}
+	else if ((mnl = mnl_socket_open2(NETLINK_ROUTE, SOCK_CLOEXEC))
+								== NULL) {
+		error("mnl_socket_open2: %m\n");
+		abort();
+	}
+
+	fd = mnl_socket_get_fd(mnl);
+
+	/* Failure just means a higher risk of ENOBUFS & resyncs */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf) < 0)
+		warn("setsockopt(SO_RCVBUF): %m\n");
+
+	/* Not supported before Linux 4.20; dumps are then unfiltered */
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one,
+		       sizeof one) == 0) {
+		strict_chk = 1;
+	}
+	else {
+		dbug("setsockopt(NETLINK_GET_STRICT_CHK): %m\n");
+	}
+
+	if (strict_dump)
+		filter_notifications(fd);
+
+	if (record_path != NULL)
+		capture_open();
+
+	/* Already bound, with notifications queued since the cache was saved */
+	if (restored_fd >= 0 && restored.data != NULL) {
+		cache_restore();
+		cache_update();
+		return;
+	}
+
+	if (restored_fd < 0 && mnl_socket_bind(mnl, groups,
+					       MNL_SOCKET_AUTOPID) < 0) {
+		error("mnl_socket_bind: %m\n");
+		abort();
+	}
+
+	cache_resync();
+}
+
+/*
+ *	Response
+ */
+
+/*
+ * Response formats
+ *
+ *	FMT_TEXT	One line per address (<ifname> <address>), followed by
+ *			a line per delegated prefix (__PREFIX__ <network>/
+ *			<length>, and its uplink, if any).  This is also what
+ *			old (unframed) clients get.
+ *
+ *	FMT_TLV		A sequence of binary records, each consisting of a type
+ *			(1 byte), a value length (2 bytes) and the value.  All
+ *			integers are in network byte order.  Addresses refer to
+ *			interfaces by index; a TLV_LINK record is included for
+ *			every interface that has at least one address.  An
+ *			address or prefix that expires is followed by a
+ *			TLV_LIFETIME record, so clients can check again when
+ *			it does.  Clients must ignore unknown record types.
+ *
+ *	An IPv4 address with a label other than its interface's name (e.g.
+ *	eth0:1) is named by its label, in the text format and by if= filters.
+ *	In the TLV format, the address is followed by a TLV_LABEL record, so
+ *	clients can match it the same way.
+ */
+
+enum format { FMT_TEXT, FMT_TLV, FMT_COUNT };
+
+static const char *const format_names[FMT_COUNT] = { "text", "tlv" };
+
+enum tlv_type {
+	TLV_LINK	= 1,	/* ifindex (4), name (variable) */
+	TLV_ADDR4	= 2,	/* ifindex (4), prefixlen (1), flags (1),
+				   address (4) */
+	TLV_ADDR6	= 3,	/* ifindex (4), prefixlen (1), flags (1),
+				   address (16) */
+	TLV_PREFIX	= 4,	/* prefixlen (1), flags (1), network (16),
+				   uplink (variable; absent if untagged) */
+	TLV_LIFETIME	= 5,	/* preferred (4), valid (4): Unix times (0 if
+				   expired, LIFETIME_INFINITE if never) for
+				   the preceding address or prefix */
+	TLV_LABEL	= 6,	/* label (variable) of the preceding IPv4
+				   address, if not its interface's name */
+};
+
+/* Address flags */
+enum tlv_flag {
+	TLV_F_TEMPORARY		= 0x01,	/* IPv6 privacy address */
+	TLV_F_TENTATIVE		= 0x02,	/* duplicate address detection */
+	TLV_F_DEPRECATED	= 0x04,	/* preferred lifetime has expired */
+	TLV_F_DADFAILED		= 0x08,	/* duplicate address */
+};
+
+/*
+ * Query filters (see Connections) are evaluated against the cache while
+ * rendering, so clients only get the records they asked for.  Filters are
+ * compared with memcmp(), so they must be zeroed before they're filled in.
+ */
+
+#define FILTER_IFNAMES		8
+
+struct filter {
+	char ifnames[FILTER_IFNAMES][IF_NAMESIZE];
+	unsigned num_ifnames;
+	sa_family_t family;		/* AF_UNSPEC matches both */
+	_Bool global;			/* global unicast addresses only */
+	_Bool prefix_only;
+};
+
+struct net4 {
+	uint32_t addr;			/* host byte order */
+	uint8_t len;
+};
+
+/* Everything that netaddr's is_public_ip() rejects */
+static const struct net4 nonglobal4[] = {
+	{ 0x00000000,  8 },		/* "this" network */
+	{ 0x0a000000,  8 },		/* private */
+	{ 0x64400000, 10 },		/* shared address space */
+	{ 0x7f000000,  8 },		/* loopback */
+	{ 0xa9fe0000, 16 },		/* link-local */
+	{ 0xac100000, 12 },		/* private */
+	{ 0xc0000000, 24 },		/* IETF protocol assignments */
+	{ 0xc0000200, 24 },		/* documentation */
+	{ 0xc0586300, 24 },		/* 6to4 relay anycast */
+	{ 0xc0a80000, 16 },		/* private */
+	{ 0xc6120000, 15 },		/* benchmarking */
+	{ 0xc6336400, 24 },		/* documentation */
+	{ 0xcb007100, 24 },		/* documentation */
+	{ 0xe0000000,  3 },		/* multicast and reserved */
+};
+
+static _Bool is_global(const sa_family_t family,
+		       const union inX_addr *const addr)
+{
+	uint32_t a, mask;
+	size_t i;
+
+	/* Link-local, ULA, multicast, mapped etc. are all outside 2000::/3 */
+	if (family == AF_INET6)
+		return (addr->in6.s6_addr[0] & 0xe0) == 0x20;
+
+	a = ntohl(addr->in.s_addr);
+
+	for (i = 0; i < sizeof nonglobal4 / sizeof nonglobal4[0]; ++i) {
+		mask = ~(uint32_t)0 << (32 - nonglobal4[i].len);
+		if ((a & mask) == nonglobal4[i].addr)
+			return 0;
+	}
+
+	return 1;
+}
+
+static _Bool addr_matches(const struct address *const addr,
+			  const struct filter *const filter)
+{
+	const char *name;
+	unsigned i;
+
+	if (filter == NULL)
+		return 1;
+
+	if (filter->prefix_only)
+		return 0;
+
+	if (filter->family != AF_UNSPEC && addr->family != filter->family)
+		return 0;
+
+	if (filter->global && !is_global(addr->family, &addr->addr))
+		return 0;
+
+	if (filter->num_ifnames == 0)
+		return 1;
+
+	name = cache_ifname(addr);
+
+	for (i = 0; i < filter->num_ifnames; ++i) {
+		if (strcmp(name, filter->ifnames[i]) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Every candidate route is a delegated prefix, except that the same prefix
+ * (from the same uplink) in another table or with another metric is only
+ * listed once.  Prefixes aren't associated with an interface, so if= doesn't
+ * apply.
+ */
+static _Bool prefix_listed(const size_t i, const struct filter *const filter)
+{
+	const struct route *const prefix = &cache.routes[i];
+	const struct route *prev;
+
+	if (i > 0) {
+		prev = &cache.routes[i - 1];
+		if (prev->len == prefix->len && prev->uplink == prefix->uplink
+				&& memcmp(&prev->dst, &prefix->dst,
+					  sizeof prefix->dst) == 0)
+			return 0;
+	}
+
+	if (filter == NULL)
+		return 1;
+
+	if (filter->family == AF_INET)
+		return 0;
+
+	if (filter->global && !is_global(AF_INET6,
+					 (const union inX_addr *)&prefix->dst))
+		return 0;
+
+	return 1;
+}
+
+static void render_text(struct buffer *const b,
+			const struct filter *const filter)
+{
+	char addrbuf[INET6_ADDRSTRLEN];
+	const struct address *addr;
+	const struct route *prefix;
+	sa_family_t family;
+	size_t i;
+
+	/* IPv4 addresses first, like getifaddrs(3) */
+	for (family = AF_INET; ; family = AF_INET6) {
+
+		for (i = 0; i < cache.num_addrs; ++i) {
+
+			addr = &cache.addrs[i];
+			if (addr->family != family
+					|| !addr_matches(addr, filter))
+				continue;
+
+			if (inet_ntop(family, &addr->addr, addrbuf,
+				      sizeof addrbuf) == NULL) {
+				error("inet_ntop: %m\n");
+				abort();
+			}
+
+			bprintf(b, "%s %s\n", cache_ifname(addr), addrbuf);
+		}
+
+		if (family == AF_INET6)
+			break;
+	}
+
+	for (i = 0; i < cache.num_routes; ++i) {
+
+		if (!prefix_listed(i, filter))
+			continue;
+
+		prefix = &cache.routes[i];
+
+		if (inet_ntop(AF_INET6, &prefix->dst, addrbuf,
+			      sizeof addrbuf) == NULL) {
+			error("inet_ntop: %m\n");
+			abort();
+		}
+
+		bprintf(b, "__PREFIX__ %s/%" PRIu8 "%s%s\n", addrbuf,
+			prefix->len, prefix->uplink != NULL ? " " : "",
+			prefix->uplink != NULL ? prefix->uplink : "");
+	}
+}
+
+static void tlv_put(struct buffer *const b, const uint8_t type,
+		    const void *const value, const size_t len)
+{
+	uint8_t hdr[3];
+
+	hdr[0] = type;
+	hdr[1] = (uint8_t)(len >> 8);
+	hdr[2] = (uint8_t)len;
+
+	bput(b, hdr, sizeof hdr);
+	bput(b, value, len);
+}
+
+static uint8_t tlv_flags(const struct address *const addr)
+{
+	uint8_t flags = 0;
+
+	/* IFA_F_TEMPORARY is IFA_F_SECONDARY for IPv4 */
+	if (addr->family == AF_INET6 && (addr->flags & IFA_F_TEMPORARY))
+		flags |= TLV_F_TEMPORARY;
+	if (addr->flags & IFA_F_TENTATIVE)
+		flags |= TLV_F_TENTATIVE;
+	if (addr->flags & IFA_F_DEPRECATED)
+		flags |= TLV_F_DEPRECATED;
+	if (addr->flags & IFA_F_DADFAILED)
+		flags |= TLV_F_DADFAILED;
+
+	return flags;
+}
+
+static void tlv_lifetime(struct buffer *const b, const uint32_t preferred,
+			 const uint32_t valid)
+{
+	uint32_t value[2];
+
+	if (preferred == LIFETIME_INFINITE && valid == LIFETIME_INFINITE)
+		return;
+
+	value[0] = htonl(preferred);
+	value[1] = htonl(valid);
+	tlv_put(b, TLV_LIFETIME, value, sizeof value);
+}
+
+static void render_tlv(struct buffer *const b,
+		       const struct filter *const filter)
+{
+	uint8_t value[4 + 1 + 1 + sizeof(struct in6_addr) + UPLINK_NAMESIZE];
+	const struct address *addr;
+	const struct route *prefix;
+	const struct iface *iface;
+	uint32_t index;
+	size_t i, j, len;
+
+	/* Only the links that at least one of the addresses refers to */
+	for (i = 0; i < cache.num_ifaces; ++i) {
+
+		iface = &cache.ifaces[i];
+
+		for (j = 0; j < cache.num_addrs; ++j) {
+			if (cache.addrs[j].ifindex == iface->index
+				&& addr_matches(&cache.addrs[j], filter))
+				break;
+		}
+
+		if (j == cache.num_addrs)
+			continue;
+
+		index = htonl(iface->index);
+		len = strlen(iface->name);
+		memcpy(value, &index, sizeof index);
+		memcpy(value + sizeof index, iface->name, len);
+		tlv_put(b, TLV_LINK, value, sizeof index + len);
+	}
+
+	for (i = 0; i < cache.num_addrs; ++i) {
+
+		addr = &cache.addrs[i];
+		if (!addr_matches(addr, filter))
+			continue;
+
+		index = htonl(addr->ifindex);
+		len = addr->family == AF_INET ? sizeof addr->addr.in
+					      : sizeof addr->addr.in6;
+
+		memcpy(value, &index, sizeof index);
+		value[4] = addr->prefixlen;
+		value[5] = tlv_flags(addr);
+		memcpy(value + 6, &addr->addr, len);
+
+		tlv_put(b, addr->family == AF_INET ? TLV_ADDR4 : TLV_ADDR6,
+			value, 6 + len);
+
+		/* The name that the text format (and if=) uses */
+		iface = cache_find_iface(addr->ifindex);
+		if (addr->label[0] != 0 && (iface == NULL
+				|| strcmp(addr->label, iface->name) != 0))
+			tlv_put(b, TLV_LABEL, addr->label, strlen(addr->label));
+
+		tlv_lifetime(b, addr->preferred, addr->valid);
+	}
+
+	for (i = 0; i < cache.num_routes; ++i) {
+
+		if (!prefix_listed(i, filter))
+			continue;
+
+		prefix = &cache.routes[i];
+		len = prefix->uplink != NULL ? strlen(prefix->uplink) : 0;
+
+		value[0] = prefix->len;
+		value[1] = 0;
+		memcpy(value + 2, &prefix->dst, sizeof prefix->dst);
+		memcpy(value + 2 + sizeof prefix->dst, prefix->uplink, len);
+		tlv_put(b, TLV_PREFIX, value, 2 + sizeof prefix->dst + len);
+		tlv_lifetime(b, prefix->expires, prefix->expires);
+	}
+}
+
+/*
+ * Rendered responses are immutable and reference counted, so any number of
+ * connections (in any worker thread) can send the same snapshot without
+ * copying it.  The frame header is rendered along with the body; legacy
+ * clients get just the body.
+ */
+struct snapshot {
+	unsigned refs;
+	uint64_t generation;
+	uint64_t etag;		/* OK responses only */
+	size_t hdr_len;
+	size_t hdr_opts;	/* where " len=" starts, for adding options */
+	char hdr[96];
+	size_t len;
+	char data[];
+};
+
+/*
+ * The current responses and keepalive, re-rendered by the main thread when
+ * the cache changes.  Each worker has its own references to them, which it
+ * updates from the shared set when it's notified of a change.
+ */
+static __thread struct snapshot *current[FMT_COUNT] = { NULL };
+static __thread struct snapshot *ping = NULL;
+static __thread uint64_t generation = 0;
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snapshot *shared[FMT_COUNT] = { NULL };
+static struct snapshot *shared_ping = NULL;
+static uint64_t shared_generation = 0;
+
+static struct snapshot *snapshot_get(struct snapshot *const snap)
+{
+	__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+	return snap;
+}
+
+static void snapshot_put(struct snapshot *const snap)
+{
+	if (snap != NULL && __atomic_sub_fetch(&snap->refs, 1,
+					       __ATOMIC_ACQ_REL) == 0)
+		free(snap);
+}
+
+__attribute__((format(printf, 3, 4)))
+static struct snapshot *snapshot_new(const void *const data, const size_t len,
+				     const char *const fmt, ...)
+{
+	struct snapshot *snap;
+	va_list ap;
+	int ret;
+
+	if ((snap = malloc(sizeof *snap + len)) == NULL) {
+		error("malloc: %m\n");
+		abort();
+	}
+
+	va_start(ap, fmt);
+	ret = vsnprintf(snap->hdr, sizeof snap->hdr, fmt, ap);
+	va_end(ap);
+
+	if (ret < 0 || ret >= (int)sizeof snap->hdr) {
+		error("vsnprintf: %m\n");
+		abort();
+	}
+
+	snap->hdr_opts = ret;
+	ret += snprintf(snap->hdr + ret, sizeof snap->hdr - ret,
+			" len=%zu\n", len);
+	if (ret >= (int)sizeof snap->hdr) {
+		error("Frame header too long\n");
+		abort();
+	}
+
+	snap->refs = 1;
+	snap->generation = generation;
+	snap->etag = 0;
+	snap->hdr_len = ret;
+	snap->len = len;
+	if (len > 0)
+		memcpy(snap->data, data, len);
+
+	return snap;
+}
+
+/* 64-bit FNV-1a; etags only need to change when the response does */
+static uint64_t hash64(uint64_t hash, const void *const data, const size_t len)
+{
+	const uint8_t *p;
+
+	for (p = data; p < (const uint8_t *)data + len; ++p) {
+		hash ^= *p;
+		hash *= UINT64_C(0x100000001b3);
+	}
+
+	return hash;
+}
+
+static struct snapshot *snapshot_ok(const struct buffer *const b,
+				    const enum format fmt, const uint64_t gen)
+{
+	struct snapshot *snap;
+	uint64_t etag;
+
+	etag = hash64(UINT64_C(0xcbf29ce484222325), format_names[fmt],
+		      strlen(format_names[fmt]) + 1);
+	etag = hash64(etag, b->data, b->len);
+
+	snap = snapshot_new(b->data, b->len, "DENAT/%d OK gen=%" PRIu64
+			    " fmt=%s etag=%016" PRIx64, PROTO_VERSION,
+			    gen, format_names[fmt], etag);
+	snap->generation = gen;
+	snap->etag = etag;
+
+	return snap;
+}
+
+/* The reply to a conditional request whose etag matches snap's */
+static struct snapshot *snapshot_notmod(const struct snapshot *const snap)
+{
+	++counters[M_NOT_MODIFIED];
+
+	return snapshot_new(NULL, 0, "DENAT/%d NOTMOD gen=%" PRIu64
+			    " etag=%016" PRIx64, PROTO_VERSION,
+			    snap->generation, snap->etag);
+}
+
+static void (*const renderers[FMT_COUNT])(struct buffer *,
+					   const struct filter *) = {
+	[FMT_TEXT]	= render_text,
+	[FMT_TLV]	= render_tlv,
+};
+
+/*
+ * Filtered responses are rendered when they're first asked for and then
+ * shared by every connection with the same filter, until the response
+ * changes.  Clients normally all use the same filter, so a few is plenty.
+ */
+
+#define FILTERED_MAX		16
+
+struct filtered {
+	struct filtered *next;
+	struct filter filter;
+	struct snapshot *snaps[FMT_COUNT];
+};
+
+/* Per worker, since they're cleared when the worker sees a new generation */
+static __thread struct filtered *filtered = NULL;
+static __thread unsigned num_filtered = 0;
+
+static void filtered_clear(void)
+{
+	struct filtered *f;
+	enum format fmt;
+
+	while ((f = filtered) != NULL) {
+		filtered = f->next;
+		for (fmt = 0; fmt < FMT_COUNT; ++fmt)
+			snapshot_put(f->snaps[fmt]);
+		free(f);
+	}
+
+	num_filtered = 0;
+}
+
+/* Returns a borrowed reference, valid until the response changes */
+static struct snapshot *get_response(const enum format fmt,
+				     const struct filter *const filter)
+{
+	static __thread struct buffer buf;
+	struct filtered *f;
+	uint64_t gen;
+
+	if (filter == NULL)
+		return current[fmt];
+
+	for (f = filtered; f != NULL; f = f->next) {
+		if (memcmp(&f->filter, filter, sizeof *filter) == 0)
+			break;
+	}
+
+	if (f == NULL) {
+
+		if (num_filtered == FILTERED_MAX)
+			filtered_clear();
+
+		if ((f = calloc(1, sizeof *f)) == NULL) {
+			error("calloc: %m\n");
+			abort();
+		}
+
+		memcpy(&f->filter, filter, sizeof *filter);
+		f->next = filtered;
+		filtered = f;
+		++num_filtered;
+	}
+
+	/* The cache may already be newer than this worker's generation */
+	if (f->snaps[fmt] == NULL) {
+		breset(&buf);
+		pthread_check(pthread_rwlock_rdlock(&cache_lock),
+			      "pthread_rwlock_rdlock");
+		renderers[fmt](&buf, filter);
+		gen = cache_generation;
+		pthread_check(pthread_rwlock_unlock(&cache_lock),
+			      "pthread_rwlock_unlock");
+		f->snaps[fmt] = snapshot_ok(&buf, fmt, gen);
+	}
+
+	return f->snaps[fmt];
+}
+
+/* Hands the current response to the other workers (main thread only) */
+static void share_response(void)
+{
+	static const uint64_t one = 1;
+	enum format fmt;
+	unsigned i;
+
+	pthread_check(pthread_mutex_lock(&shared_lock), "pthread_mutex_lock");
+
+	for (fmt = 0; fmt < FMT_COUNT; ++fmt) {
+		snapshot_put(shared[fmt]);
+		shared[fmt] = snapshot_get(current[fmt]);
+	}
+
+	snapshot_put(shared_ping);
+	shared_ping = snapshot_get(ping);
+	shared_generation = generation;
+
+	pthread_check(pthread_mutex_unlock(&shared_lock),
+		      "pthread_mutex_unlock");
+
+	/* Workers that haven't started yet pick it up when they do */
+	for (i = 1; i < num_workers; ++i) {
+		if (write(workers[i].notify_fd, &one, sizeof one) < 0) {
+			error("write: %m\n");
+			abort();
+		}
+	}
+}
+
+/* Takes new references to the shared response (other workers) */
+static void sync_response(void)
+{
+	enum format fmt;
+
+	pthread_check(pthread_mutex_lock(&shared_lock), "pthread_mutex_lock");
+
+	for (fmt = 0; fmt < FMT_COUNT; ++fmt) {
+		snapshot_put(current[fmt]);
+		current[fmt] = snapshot_get(shared[fmt]);
+	}
+
+	snapshot_put(ping);
+	ping = snapshot_get(shared_ping);
+	generation = shared_generation;
+
+	pthread_check(pthread_mutex_unlock(&shared_lock),
+		      "pthread_mutex_unlock");
+
+	filtered_clear();
+}
+
+/*
+ *	Shared snapshot
+ *
+ *	With -S|--shm, the current (unfiltered) TLV response is also published
+ *	in a file -- normally under /run -- that local clients can map and
+ *	read without any system calls, or any help from denatd.  The file is a
+ *	header followed by the body:
+ *
+ *		magic		"DENATSH1"
+ *		seq		Odd while the snapshot is being updated
+ *		generation	}
+ *		etag		} As in OK frames (see Connections)
+ *		len		Body length
+ *
+ *	All fields are uint64_t, in host byte order.  Readers copy the fields
+ *	and the body, and retry if seq was odd or changed meanwhile (a seqlock).
+ *	The file only grows, so readers only need to remap it when the body is
+ *	bigger than their mapping.  libdenatc has a reader.
+ */
+
+#define SHM_MAGIC		"DENATSH1"
+#define SHM_INITIAL		65536
+
+struct shm_header {
+	char magic[sizeof SHM_MAGIC - 1];
+	uint64_t seq;
+	uint64_t generation;
+	uint64_t etag;
+	uint64_t len;
+};
+
+static struct shm_header *shm = NULL;
+static size_t shm_size;
+static int shm_fd = -1;
+
+static void shm_map(const size_t size)
+{
+	if (ftruncate(shm_fd, size) < 0) {
+		error("ftruncate: %s: %m\n", shm_path);
+		abort();
+	}
+
+	if (shm != NULL && munmap(shm, shm_size) < 0) {
+		error("munmap: %m\n");
+		abort();
+	}
+
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	if (shm == MAP_FAILED) {
+		error("mmap: %s: %m\n", shm_path);
+		abort();
+	}
+
+	shm_size = size;
+}
+
+static void get_shm(void)
+{
+	struct stat st;
+
+	shm_fd = open(shm_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		      0644);
+	if (shm_fd < 0 || fstat(shm_fd, &st) < 0) {
+		error("%s: %m\n", shm_path);
+		abort();
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		error("%s exists and is not a regular file\n", shm_path);
+		abort();
+	}
+
+	shm_map((size_t)st.st_size > sizeof *shm + SHM_INITIAL
+			? (size_t)st.st_size : sizeof *shm + SHM_INITIAL);
+
+	/* Left by a previous instance, whose readers may still be reading */
+	if (memcmp(shm->magic, SHM_MAGIC, sizeof shm->magic) == 0) {
+		dbug("Reusing shared snapshot %s\n", shm_path);
+		return;
+	}
+
+	memset(shm, 0, sizeof *shm);
+	memcpy(shm->magic, SHM_MAGIC, sizeof shm->magic);
+}
+
+static void shm_publish(const struct snapshot *const snap)
+{
+	uint64_t seq;
+	size_t size;
+
+	if (shm == NULL)
+		return;
+
+	if (sizeof *shm + snap->len > shm_size) {
+		size = shm_size * 2;
+		if (size < sizeof *shm + snap->len)
+			size = sizeof *shm + snap->len;
+		shm_map(size);
+	}
+
+	/* Even if a previous instance died while updating it */
+	seq = (shm->seq + 1) | 1;
+
+	__atomic_store_n(&shm->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	shm->generation = snap->generation;
+	shm->etag = snap->etag;
+	shm->len = snap->len;
+	memcpy(shm + 1, snap->data, snap->len);
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns 1 if the response has changed */
+static int render_response(void)
+{
+	static struct buffer bufs[FMT_COUNT];
+	enum format fmt;
+	_Bool changed;
+	int64_t start;
+
+	start = now_us();
+	changed = 0;
+
+	for (fmt = 0; fmt < FMT_COUNT; ++fmt) {
+
+		breset(&bufs[fmt]);
+		renderers[fmt](&bufs[fmt], NULL);
+
+		if (current[fmt] == NULL || current[fmt]->len != bufs[fmt].len
+				|| memcmp(bufs[fmt].data, current[fmt]->data,
+					  bufs[fmt].len) != 0) {
+			changed = 1;
+		}
+	}
+
+	observe(H_RENDER, now_us() - start);
+
+	if (!changed)
+		return 0;
+
+	++counters[M_RESPONSE_CHANGES];
+	cache_generation = ++generation;
+	filtered_clear();
+
+	for (fmt = 0; fmt < FMT_COUNT; ++fmt) {
+		snapshot_put(current[fmt]);
+		current[fmt] = snapshot_ok(&bufs[fmt], fmt, generation);
+	}
+
+	snapshot_put(ping);
+	ping = snapshot_new(NULL, 0, "DENAT/%d PING gen=%" PRIu64,
+			    PROTO_VERSION, generation);
+
+	shm_publish(current[FMT_TLV]);
+
+	dbug("Response changed (generation %" PRIu64 ")\n", generation);
+
+	if (num_workers > 1)
+		share_response();
+
+	return 1;
+}
+
+/*
+ * Applies any pending notifications and re-renders the response, without
+ * letting the workers into the cache in between.  A filtered response is
+ * then never rendered from changes that its generation doesn't include.
+ * Returns 1 if the response has changed.
+ */
+static int update_response(void)
+{
+	int changed;
+
+	pthread_check(pthread_rwlock_wrlock(&cache_lock),
+		      "pthread_rwlock_wrlock");
+	cache_update();
+	changed = render_response();
+	pthread_check(pthread_rwlock_unlock(&cache_lock),
+		      "pthread_rwlock_unlock");
+
+	return changed;
+}
+
+/*
+ *	Client filter
+ *
+ *	With -A|--allow, a classic BPF program attached to every listening and
+ *	UDP socket drops packets whose source isn't in an allowed prefix.  The
+ *	kernel runs it before answering a SYN or queueing a datagram, so
+ *	unwanted clients never wake a worker (or cost a response); it counts
+ *	what's dropped as socket drops (see Metrics socket).
+ *
+ *	The program reads the source address from the network header, so an
+ *	IPv4 client of an IPv6 socket is matched against the IPv4 prefixes.
+ *	Each prefix is a run of 32-bit comparisons ending in an accept, so
+ *	every jump is short.
+ */
+
+#define FILTER_ACCEPT	0xffffffff
+#define FILTER_DROP	0
+
+/* Per prefix: load, mask and compare each word, then accept */
+#define FILTER_MAX	(4 + ALLOW_MAX * 13 + 2)
+
+/* Appends the checks for one family's prefixes, and a drop */
+static unsigned filter_family(struct sock_filter *const code, unsigned n,
+			      const sa_family_t family)
+{
+	/* Offset of the source address in the IPv4 or IPv6 header */
+	const uint32_t src = (family == AF_INET) ? 12 : 8;
+	unsigned i, w, words, end;
+	const struct allow *a;
+	uint32_t value, mask;
+
+	for (i = 0; i < num_allows; ++i) {
+
+		a = &allows[i];
+		if (a->family != family)
+			continue;
+
+		words = (a->plen + 31) / 32;
+		end = n + words * 2 + (a->plen % 32 != 0) + 1;
+
+		for (w = 0; w < words; ++w) {
+
+			memcpy(&value, a->addr + w * 4, sizeof value);
+			value = ntohl(value);
+
+			code[n++] = (struct sock_filter)BPF_STMT(
+					BPF_LD | BPF_W | BPF_ABS,
+					SKF_NET_OFF + src + w * 4);
+
+			if (w == a->plen / 32) {
+				mask = ~(uint32_t)0 << (32 - a->plen % 32);
+				code[n++] = (struct sock_filter)BPF_STMT(
+						BPF_ALU | BPF_AND | BPF_K,
+						mask);
+			}
+
+			/* On a mismatch, skip to the next prefix */
+			code[n] = (struct sock_filter)BPF_JUMP(
+					BPF_JMP | BPF_JEQ | BPF_K, value,
+					0, end - n - 1);
+			++n;
+		}
+
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+							 FILTER_ACCEPT);
+	}
+
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, FILTER_DROP);
+
+	return n;
+}
+
+/* Attaches the filter to a socket or, with no -A|--allow, removes it */
+static void filter_clients(const int fd)
+{
+	static struct sock_filter code[FILTER_MAX];
+	static struct sock_fprog prog = { .len = 0, .filter = code };
+	unsigned n;
+
+	/* An inherited socket may have an old image's filter */
+	if (num_allows == 0) {
+		if (setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0) < 0
+				&& errno != ENOENT) {
+			warn("setsockopt(SO_DETACH_FILTER): %m\n");
+		}
+		return;
+	}
+
+	if (prog.len == 0) {
+
+		code[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+						       SKF_NET_OFF);
+		code[1] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_RSH | BPF_K,
+						       4);
+		code[2] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+						       4, 1, 0);
+
+		/* IPv4 checks at 4, IPv6 after them; may be too far for jf */
+		n = filter_family(code, 4, AF_INET);
+		code[3] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, n - 4);
+		n = filter_family(code, n, AF_INET6);
+
+		prog.len = n;
+	}
+
+	/* Failing open would be worse than not starting */
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		       sizeof prog) < 0) {
+		error("setsockopt(SO_ATTACH_FILTER): %m\n");
+		abort();
+	}
+}
+
+/*
+ *	Listening socket
+ */
+
+/*
+ * A program for a SO_REUSEPORT group, which returns the index of the socket
+ * to use: the receiving CPU modulo the number of workers.  Sockets are
+ * indexed in the order they were bound, which is by worker.
+ */
+static void steer_by_cpu(const int fd)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_workers),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof code / sizeof code[0],
+		.filter = code,
+	};
+
+	/* Failure just means that the kernel picks workers by flow hash */
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+		       sizeof prog) < 0) {
+		warn("setsockopt(SO_ATTACH_REUSEPORT_CBPF): %m\n");
+	}
+}
+
+/* SOCK_STREAM or SOCK_DGRAM, for the given worker */
+static int get_socket(const struct laddr *const la, const int type,
+		      const unsigned worker)
+{
+	static const int one = 1;
+	char buf[INET6_ADDRSTRLEN];
+	union sockaddr_inX addr;
+	socklen_t addrlen;
+	int fd;
+
+	fd = socket(la->family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		error("socket: %m\n");
+		abort();
+	}
+
+	if (num_workers > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one,
+					  sizeof one) < 0) {
+		error("setsockopt(SO_REUSEPORT): %m\n");
+		abort();
+	}
+
+	memset(&addr, 0, sizeof addr);
+
+	if (la->family == AF_INET) {
+
+		addr.in.sin_family = AF_INET;
+		addr.in.sin_port = htons(lport);
+		addr.in.sin_addr = la->in;
+		addrlen = sizeof addr.in;
+
+		if (inet_ntop(AF_INET, &la->in, buf, sizeof buf) == NULL) {
+			error("inet_ntop: %m\n");
+			abort();
+		}
+	}
+	else {
+		addr.in6.sin6_family = AF_INET6;
+		addr.in6.sin6_port = htons(lport);
+		addr.in6.sin6_addr = la->in6;
+		addrlen = sizeof addr.in6;
+
+		if (inet_ntop(AF_INET6, &la->in6, buf, sizeof buf) == NULL) {
+			error("inet_ntop: %m\n");
+			abort();
+		}
+
+		/* Otherwise, :: would conflict with any IPv4 address */
+		if (v6only && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one,
+					 sizeof one) < 0) {
+			error("setsockopt(IPV6_V6ONLY): %m\n");
+			abort();
+		}
+	}
+
+	/* Before bind, so nothing gets past it */
+	if (num_allows != 0)
+		filter_clients(fd);
+
+	if (bind(fd, &addr.a, addrlen) < 0) {
+		error("bind: %m\n");
+		abort();
+	}
+
+	if (type == SOCK_STREAM && listen(fd, backlog) < 0) {
+		error("listen: %m\n");
+		abort();
+	}
+
+	/* The rest applies to the whole group */
+	if (worker != 0)
+		return fd;
+
+	if (cpu_steer && num_workers > 1)
+		steer_by_cpu(fd);
+
+	if (type == SOCK_DGRAM)
+		info("Answering UDP queries on %s/%" PRIu16 "\n", buf, lport);
+	else
+		info("Listening on %s/%" PRIu16 "\n", buf, lport);
+
+	return fd;
+}
+
+static void log_conn(union sockaddr_inX *addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+	uint16_t port;
+	void *src;
+
+	if (addr->a.sa_family == AF_INET) {
+		src = &addr->in.sin_addr;
+		port = ntohs(addr->in.sin_port);
+	}
+	else {
+		src = &addr->in6.sin6_addr;
+		port = ntohs(addr->in6.sin6_port);
+	}
+
+	if (inet_ntop(addr->a.sa_family, src, buf, sizeof buf) == NULL) {
+		error("inet_ntop: %m\n");
+		abort();
+	}
+
+	dbug("Connection from %s/%" PRIu16 "\n", buf, port);
+}
+
+/*
+ *	Socket activation
+ *
+ *	When started by systemd for a socket unit (denatd.socket), denatd uses
+ *	the listening sockets that it's passed (see sd_listen_fds(3)) -- TCP
+ *	and, for ListenDatagram=, UDP -- instead of creating its own, so -l,
+ *	-p, -4 and -u don't apply.  systemd keeps them open while denatd isn't
+ *	running, so with -i|--idle-timeout, denatd can exit when it's idle and
+ *	be started again by the next client.  Restarts (see Restarts) use the
+ *	same protocol.
+ */
+
+#define SD_LISTEN_FDS_START	3
+
+static _Bool activated = 0;
+
+/* Passed by systemd or, on a restart, by the previous image (see Restarts) */
+static _Bool inherited = 0;
+static int *inherited_tcp = NULL;
+static size_t num_inherited_tcp = 0;
+static size_t max_inherited_tcp = 0;
+static int *inherited_udp = NULL;
+static size_t num_inherited_udp = 0;
+static size_t max_inherited_udp = 0;
+
+static long listen_env(const char *const name)
+{
+	const char *value;
+	char *endptr;
+	long n;
+
+	if ((value = getenv(name)) == NULL)
+		return -1;
+
+	errno = 0;
+	n = strtol(value, &endptr, 10);
+	if (errno != 0 || *value == 0 || *endptr != 0 || n < 0) {
+		error("Invalid %s: '%s'\n", name, value);
+		abort();
+	}
+
+	return n;
+}
+
+/* Sets inherited (and activated) if denatd was started with sockets to use */
+static void get_inherited(void)
+{
+	int fd, type, domain, flags;
+	socklen_t len;
+	long n;
+
+	if (listen_env("LISTEN_PID") != (long)getpid())
+		return;
+
+	n = listen_env("LISTEN_FDS");
+
+	/* Don't pass them on (not that denatd runs anything) */
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	if (n <= 0)
+		return;
+
+	for (fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n; ++fd) {
+
+		len = sizeof type;
+		if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0) {
+			error("getsockopt(%d, SO_TYPE): %m\n", fd);
+			abort();
+		}
+
+		len = sizeof domain;
+		if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0) {
+			error("getsockopt(%d, SO_DOMAIN): %m\n", fd);
+			abort();
+		}
+
+		if ((domain != AF_INET && domain != AF_INET6)
+				|| (type != SOCK_STREAM && type != SOCK_DGRAM)) {
+			error("Inherited socket %d isn't TCP or UDP\n", fd);
+			abort();
+		}
+
+		if ((flags = fcntl(fd, F_GETFL)) < 0
+				|| fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0
+				|| fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+			error("fcntl: %m\n");
+			abort();
+		}
+
+		/* A restart passes every worker's sockets, so no fixed limit */
+		if (type == SOCK_STREAM) {
+			inherited_tcp = grow(inherited_tcp, &max_inherited_tcp,
+					     num_inherited_tcp,
+					     sizeof *inherited_tcp);
+			inherited_tcp[num_inherited_tcp++] = fd;
+		}
+		else {
+			inherited_udp = grow(inherited_udp, &max_inherited_udp,
+					     num_inherited_udp,
+					     sizeof *inherited_udp);
+			inherited_udp[num_inherited_udp++] = fd;
+		}
+	}
+
+	info("Using %zu inherited TCP and %zu UDP sockets\n",
+	     num_inherited_tcp, num_inherited_udp);
+
+	inherited = 1;
+	activated = 1;
+}
+
+/* Picks up where the previous image left off (see Restarts) */
+static void get_state(void)
+{
+	struct capture cap;
+	struct state st;
+	long fd;
+
+	if ((fd = listen_env("DENATD_STATE")) < 0)
+		return;
+
+	unsetenv("DENATD_STATE");
+
+	read_all(fd, "restart state", &cap);
+	close(fd);
+
+	if (cap.len < sizeof st
+		|| memcmp(cap.data, STATE_MAGIC, sizeof st.magic) != 0) {
+		warn("Ignoring invalid restart state\n");
+		free(cap.data);
+		return;
+	}
+
+	memcpy(&st, cap.data, sizeof st);
+	cap.len -= sizeof st;
+	memmove(cap.data, cap.data + sizeof st, cap.len);
+
+	/* Only as systemd started the previous image */
+	activated = st.activated;
+	generation = st.generation;
+	restored_fd = st.netlink_fd;
+
+	if (restored_fd >= 0 && st.rtproto == rtproto && is_capture(&cap)) {
+		restored = cap;
+		restored_at = st.saved;
+		info("Restarted with the previous cache\n");
+	}
+	else {
+		free(cap.data);
+		info("Restarted without the previous cache\n");
+	}
+}
+
+
+/*
+ *	Connections
+ *
+ *	A client may send a request line as soon as it connects:
+ *
+ *		DENAT/<version> [option ...]\n
+ *
+ *	and then receives one or more framed responses:
+ *
+ *		DENAT/1 <status> [<name>=<value> ...] len=<bytes>\n<body>
+ *
+ *	OK and PING frames carry the generation (gen=) of the response, which
+ *	is incremented every time the response changes.  OK frames also carry
+ *	an entity tag (etag=), a hash of the body and its format, which
+ *	(unlike the generation) is the same for the same response across
+ *	restarts and filters.
+ *
+ *	Older clients send nothing; if no request arrives within the request
+ *	wait time, they get the unframed response and the connection is closed.
+ *	So does a client that shuts down its side, or sends anything that
+ *	doesn't start with "DENAT/", without waiting.
+ *
+ *	Options:
+ *
+ *		subscribe	Keep the connection open; a new OK frame is sent
+ *				whenever the response changes and a PING frame
+ *				(with an empty body) every keepalive interval.
+ *
+ *		format=<name>	Response body format: text (the default) or tlv
+ *				(see Response formats).  OK frames identify the
+ *				format (fmt=).  Clients can offer the newest
+ *				format they support and fall back if they get
+ *				an ERROR response.
+ *
+ *		if=<name>[,<name> ...]
+ *				Only addresses on these interfaces (IPv4
+ *				addresses with a label, such as eth0:1, only
+ *				by that label; see Response formats).
+ *
+ *		family=4|6	Only addresses of this family.
+ *
+ *		scope=global|any
+ *				global: only global unicast addresses (and
+ *				prefix); no loopback, link-local, private,
+ *				ULA, multicast or reserved ones.
+ *
+ *		prefix-only	Only the delegated prefix.
+ *
+ *		persist		Keep the connection open after the response, for
+ *				another request.  Every request on it must ask
+ *				again (or the connection is closed after its
+ *				response), and may be sent before the previous
+ *				response has been received.  A connection is
+ *				closed after waiting -I|--persist-idle seconds
+ *				for a request (0 disables persistence), or after
+ *				-Q|--persist-max requests, so clients should be
+ *				ready to reconnect.  Not for subscriptions.
+ *
+ *		if-none-match=<etag>
+ *				If the response still has this etag, send a
+ *				NOTMOD frame (with the generation and etag,
+ *				and an empty body) instead of the OK frame.
+ *				Subscribers get it in place of their first OK
+ *				frame only.
+ *
+ *	Filtered subscribers only get an OK frame when their filtered response
+ *	changes.
+ *
+ *	Every connection in a given state has the same timeout, so each state
+ *	has its own list, which is kept sorted by deadline simply by appending
+ *	connections to its tail.  (Persistent connections waiting for their
+ *	next request are CONN_IDLE, on a list of their own, since they mustn't
+ *	get a legacy response.)
+ */
+
+#define REQUEST_MAX		256
+#define REQUEST_MAGIC		"DENAT/"
+#define NONCE_MAX		32
+#define IOV_BATCH		32
+
+enum conn_state { CONN_REQUEST, CONN_RESPONSE, CONN_SUBSCRIBED, CONN_IDLE };
+
+struct conn_list {
+	struct conn *head;
+	struct conn *tail;
+	const int64_t *timeout;
+	unsigned count;
+};
+
+/* A snapshot queued for sending, with or without its frame header */
+struct output {
+	struct output *next;
+	struct snapshot *snap;
+	_Bool framed;
+	size_t sent;
+};
+
+struct conn {
+	struct conn *prev;
+	struct conn *next;
+	struct conn_list *list;
+	int64_t deadline;
+	struct output *out_head;
+	struct output *out_tail;
+	size_t pending;		/* bytes queued but not yet sent */
+	uint64_t total_sent;
+	uint64_t stalled;	/* total_sent at last keepalive (subscribers) */
+	int64_t accepted;	/* microseconds (or the latest request's, if
+				   persistent); 0 for metrics connections */
+	struct filter *filter;	/* NULL if unfiltered */
+	struct snapshot *last;	/* last response queued (subscribers) */
+	char req[REQUEST_MAX];
+	size_t req_len;
+	unsigned requests;
+	_Bool persist;		/* after the current response */
+	uint32_t events;
+	int fd;
+	enum conn_state state;
+	enum format format;
+};
+
+/* Connections belong to the worker that accepted them (see Workers) */
+static __thread struct conn_list requesting = { .timeout = &request_wait };
+static __thread struct conn_list responding = { .timeout = &conn_timeout };
+static __thread struct conn_list subscribed = { .timeout = &keepalive };
+static __thread struct conn_list idle = { .timeout = &persist_idle };
+
+/*
+ * Closed connections can't be freed until the current batch of epoll events
+ * has been processed, because an event for one of them may be pending.
+ */
+static __thread struct conn *closed = NULL;
+
+static __thread unsigned conn_count = 0;
+
+static __thread int epoll_fd;
+
+/*
+ * The worker's listening sockets (see Workers).  Their addresses are used as
+ * epoll data pointers.
+ */
+static __thread int *listen_fds;
+
+/* Used as the epoll data pointer for the worker's notification eventfd */
+static __thread int notify_fd = -1;
+
+static void list_remove(struct conn *const conn)
+{
+	struct conn_list *const list = conn->list;
+
+	if (conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		list->head = conn->next;
+
+	if (conn->next != NULL)
+		conn->next->prev = conn->prev;
+	else
+		list->tail = conn->prev;
+
+	conn->list = NULL;
+	--list->count;
+}
+
+static void list_append(struct conn_list *const list, struct conn *const conn,
+			const int64_t now)
+{
+	if (conn->list != NULL)
+		list_remove(conn);
+
+	conn->next = NULL;
+	conn->prev = list->tail;
+	if (list->tail != NULL)
+		list->tail->next = conn;
+	else
+		list->head = conn;
+	list->tail = conn;
+
+	conn->list = list;
+	conn->deadline = now + *list->timeout;
+	++list->count;
+}
+
+static void set_events(struct conn *const conn, const uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (conn->events == events)
+		return;
+
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+		error("epoll_ctl: %m\n");
+		abort();
+	}
+
+	conn->events = events;
+}
+
+static void close_conn(struct conn *const conn)
+{
+	list_remove(conn);
+
+	/* Closing the socket also removes it from the epoll set */
+	if (close(conn->fd) < 0) {
+		error("close: %m\n");
+		abort();
+	}
+
+	conn->fd = -1;
+	conn->next = closed;
+	closed = conn;
+	--conn_count;
+
+	dbug("Connection closed\n");
+}
+
+static void free_output(struct output *const out)
+{
+	snapshot_put(out->snap);
+	free(out);
+}
+
+static void free_closed(void)
+{
+	struct output *out;
+	struct conn *conn;
+
+	while ((conn = closed) != NULL) {
+
+		closed = conn->next;
+
+		while ((out = conn->out_head) != NULL) {
+			conn->out_head = out->next;
+			free_output(out);
+		}
+
+		snapshot_put(conn->last);
+		free(conn->filter);
+		free(conn);
+	}
+}
+
+static size_t output_len(const struct output *const out)
+{
+	return (out->framed ? out->snap->hdr_len : 0) + out->snap->len;
+}
+
+/* Unsent bytes queued behind the output being sent */
+static size_t unsent_backlog(const struct conn *const conn)
+{
+	const struct output *const out = conn->out_head;
+
+	if (out == NULL)
+		return 0;
+
+	return conn->pending - (output_len(out) - out->sent);
+}
+
+/*
+ * Queue a snapshot (takes a new reference).  Returns 0 if the connection has
+ * been closed.
+ *
+ * A subscriber that falls behind only needs the latest response, so an
+ * unsent response that hasn't been started yet is replaced, rather than
+ * queueing another one behind it.
+ */
+static int queue_output(struct conn *const conn, struct snapshot *const snap,
+			const _Bool framed)
+{
+	struct output *out;
+
+	out = conn->out_tail;
+
+	if (out != NULL && out->sent == 0 && out->framed && framed
+			&& out->snap->len > 0 && snap->len > 0) {
+		conn->pending -= output_len(out);
+		snapshot_put(out->snap);
+		out->snap = snapshot_get(snap);
+		conn->pending += output_len(out);
+		return 1;
+	}
+
+	/* A client that isn't keeping up, however big the responses are */
+	if (unsent_backlog(conn) > unsent_max) {
+		warn("Too much unsent data; dropping connection\n");
+		++counters[M_UNSENT_DROPPED];
+		close_conn(conn);
+		return 0;
+	}
+
+	if ((out = malloc(sizeof *out)) == NULL) {
+		error("malloc: %m\n");
+		abort();
+	}
+
+	out->next = NULL;
+	out->snap = snapshot_get(snap);
+	out->framed = framed;
+	out->sent = 0;
+
+	if (conn->out_tail != NULL)
+		conn->out_tail->next = out;
+	else
+		conn->out_head = out;
+	conn->out_tail = out;
+
+	conn->pending += output_len(out);
+
+	return 1;
+}
+
+/* Gather everything that's queued, so it usually goes out in one syscall */
+static size_t fill_iov(const struct conn *const conn, struct iovec *const iov)
+{
+	const struct output *out;
+	size_t n, off, hdr_len;
+
+	n = 0;
+
+	for (out = conn->out_head; out != NULL && n < IOV_BATCH - 1;
+							out = out->next) {
+
+		off = out->sent;
+		hdr_len = out->framed ? out->snap->hdr_len : 0;
+
+		if (off < hdr_len) {
+			iov[n].iov_base = (char *)out->snap->hdr + off;
+			iov[n++].iov_len = hdr_len - off;
+			off = hdr_len;
+		}
+
+		if (out->snap->len > off - hdr_len) {
+			iov[n].iov_base = (char *)out->snap->data
+							+ (off - hdr_len);
+			iov[n++].iov_len = out->snap->len - (off - hdr_len);
+		}
+	}
+
+	return n;
+}
+
+static void consume_output(struct conn *const conn, size_t count)
+{
+	struct output *out;
+	size_t left;
+
+	conn->pending -= count;
+	conn->total_sent += count;
+
+	while (count > 0) {
+
+		out = conn->out_head;
+		left = output_len(out) - out->sent;
+
+		if (count < left) {
+			out->sent += count;
+			return;
+		}
+
+		count -= left;
+		conn->out_head = out->next;
+		if (conn->out_head == NULL)
+			conn->out_tail = NULL;
+		free_output(out);
+	}
+}
+
+/* Returns 0 if the connection has been closed */
+static int send_conn(struct conn *const conn)
+{
+	struct iovec iov[IOV_BATCH];
+	struct msghdr msg;
+	int64_t start;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = iov;
+
+	while (conn->pending > 0) {
+
+		msg.msg_iovlen = fill_iov(conn, iov);
+
+		start = now_us();
+		ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+		observe(H_SEND, now_us() - start);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			warn("sendmsg: %m\n");
+			++counters[M_SEND_ERRORS];
+			close_conn(conn);
+			return 0;
+		}
+
+		consume_output(conn, ret);
+	}
+
+	if (conn->pending > 0) {
+		set_events(conn, conn->state == CONN_SUBSCRIBED
+					? EPOLLIN | EPOLLRDHUP | EPOLLOUT
+					: EPOLLOUT);
+		return 1;
+	}
+
+	if (conn->state == CONN_SUBSCRIBED) {
+		set_events(conn, EPOLLIN | EPOLLRDHUP);
+		return 1;
+	}
+
+	if (conn->accepted != 0)
+		observe(H_RESPONSE, now_us() - conn->accepted);
+
+	if (!conn->persist) {
+		close_conn(conn);
+		return 0;
+	}
+
+	conn->state = CONN_IDLE;
+	list_append(&idle, conn, now_ms());
+
+	/*
+	 * The next request may already be here.  It's answered on the next
+	 * wakeup (the socket is writable), not from here, so a client that
+	 * pipelines requests can neither recurse nor hog the event loop.
+	 */
+	if (memchr(conn->req, '\n', conn->req_len) != NULL)
+		set_events(conn, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+	else
+		set_events(conn, EPOLLIN | EPOLLRDHUP);
+
+	return 1;
+}
+
+static void respond_legacy(struct conn *const conn, const int64_t now)
+{
+	++counters[M_LEGACY];
+	conn->state = CONN_RESPONSE;
+	list_append(&responding, conn, now);
+
+	if (queue_output(conn, current[FMT_TEXT], 0))
+		send_conn(conn);
+}
+
+__attribute__((format(printf, 3, 4)))
+static void respond_error(struct conn *const conn, const int64_t now,
+			  const char *const fmt, ...)
+{
+	char msg[REQUEST_MAX + 64];
+	struct snapshot *snap;
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(msg, sizeof msg, fmt, ap);
+	va_end(ap);
+
+	if (ret < 0) {
+		error("vsnprintf: %m\n");
+		abort();
+	}
+
+	if (ret >= (int)sizeof msg)
+		ret = sizeof msg - 1;
+
+	dbug("Request error: %s", msg);
+	++counters[M_REJECTED];
+
+	conn->state = CONN_RESPONSE;
+	conn->persist = 0;
+	list_append(&responding, conn, now);
+
+	snap = snapshot_new(msg, ret, "DENAT/%d ERROR", PROTO_VERSION);
+
+	if (queue_output(conn, snap, 1))
+		send_conn(conn);
+
+	snapshot_put(snap);
+}
+
+/* Returns 0 if the format isn't supported */
+static int parse_format(enum format *const format, const char *const name)
+{
+	enum format fmt;
+
+	for (fmt = 0; fmt < FMT_COUNT; ++fmt) {
+		if (strcmp(name, format_names[fmt]) == 0) {
+			*format = fmt;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Returns 0 if the list is invalid */
+static int parse_ifnames(struct filter *const filter, char *const list)
+{
+	char *name, *saveptr;
+
+	for (name = strtok_r(list, ",", &saveptr); name != NULL;
+				name = strtok_r(NULL, ",", &saveptr)) {
+
+		if (filter->num_ifnames == FILTER_IFNAMES
+				|| strlen(name) >= IF_NAMESIZE)
+			return 0;
+
+		strcpy(filter->ifnames[filter->num_ifnames++], name);
+	}
+
+	return filter->num_ifnames > 0;
+}
+
+/* Returns 0 if the nonce isn't 1-32 alphanumeric characters */
+static int valid_nonce(const char *const nonce)
+{
+	size_t len;
+
+	len = strlen(nonce);
+	if (len == 0 || len > NONCE_MAX)
+		return 0;
+
+	return strspn(nonce, "0123456789"
+			     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+			     "abcdefghijklmnopqrstuvwxyz") == len;
+}
+
+/* Returns 0 if the etag isn't 1-16 hex digits */
+static int parse_etag(uint64_t *const etag, const char *const value)
+{
+	size_t len;
+
+	len = strlen(value);
+	if (len == 0 || len > 16 || strspn(value, "0123456789"
+						  "ABCDEFabcdef") != len)
+		return 0;
+
+	*etag = strtoull(value, NULL, 16);
+
+	return 1;
+}
+
+/* A request line, as sent over TCP or in a UDP datagram */
+struct request {
+	struct filter filter;
+	enum format format;
+	_Bool subscribe;
+	_Bool persist;
+	_Bool conditional;
+	uint64_t etag;			/* if-none-match= */
+	const char *nonce;		/* points into the request line */
+	char error[REQUEST_MAX + 64];
+};
+
+__attribute__((format(printf, 2, 3)))
+static int request_error(struct request *const req, const char *const fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(req->error, sizeof req->error, fmt, ap);
+	va_end(ap);
+
+	return 0;
+}
+
+/* Returns 0 (with an error message in req->error) if the request is invalid */
+static int parse_request_line(char *const line, struct request *const req,
+			      const _Bool udp)
+{
+	char *token, *saveptr, *endptr;
+	long version;
+
+	memset(req, 0, sizeof *req);
+	req->format = FMT_TEXT;
+
+	token = strtok_r(line, " \t\r\n", &saveptr);
+
+	if (token == NULL || strncmp(token, REQUEST_MAGIC,
+				     sizeof REQUEST_MAGIC - 1) != 0)
+		return request_error(req, "Invalid request\n");
+
+	/* Clients may ask for a newer version; they get the one we speak */
+	errno = 0;
+	version = strtol(token + 6, &endptr, 10);
+	if (errno != 0 || *endptr != 0 || version < 1)
+		return request_error(req, "Invalid version: %s\n", token + 6);
+
+	while ((token = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+
+		if (strcmp(token, "subscribe") == 0 && !udp) {
+			req->subscribe = 1;
+		}
+		else if (strcmp(token, "persist") == 0 && !udp) {
+			req->persist = 1;
+		}
+		else if (strncmp(token, "nonce=", 6) == 0 && udp) {
+			if (!valid_nonce(token + 6))
+				return request_error(req, "Invalid nonce\n");
+			req->nonce = token + 6;
+		}
+		else if (strncmp(token, "format=", 7) == 0) {
+			if (!parse_format(&req->format, token + 7)) {
+				return request_error(req, "Unsupported format: "
+						     "%s (supported: text "
+						     "tlv)\n", token + 7);
+			}
+		}
+		else if (strncmp(token, "if=", 3) == 0) {
+			if (!parse_ifnames(&req->filter, token + 3)) {
+				return request_error(req, "Invalid interface "
+						     "list (at most %d "
+						     "names)\n",
+						     FILTER_IFNAMES);
+			}
+		}
+		else if (strcmp(token, "family=4") == 0) {
+			req->filter.family = AF_INET;
+		}
+		else if (strcmp(token, "family=6") == 0) {
+			req->filter.family = AF_INET6;
+		}
+		else if (strcmp(token, "scope=global") == 0) {
+			req->filter.global = 1;
+		}
+		else if (strcmp(token, "scope=any") == 0) {
+			req->filter.global = 0;
+		}
+		else if (strcmp(token, "prefix-only") == 0) {
+			req->filter.prefix_only = 1;
+		}
+		else if (strncmp(token, "if-none-match=", 14) == 0) {
+			if (!parse_etag(&req->etag, token + 14))
+				return request_error(req, "Invalid etag\n");
+			req->conditional = 1;
+		}
+		else {
+			return request_error(req, "Unknown option: %s\n",
+					     token);
+		}
+	}
+
+	if (udp && req->nonce == NULL)
+		return request_error(req, "Missing nonce\n");
+
+	if (req->persist && req->subscribe)
+		return request_error(req, "Subscriptions can't persist\n");
+
+	return 1;
+}
+
+/* NULL if the request isn't filtered */
+static const struct filter *request_filter(const struct request *const req)
+{
+	const struct filter *const filter = &req->filter;
+
+	if (filter->num_ifnames > 0 || filter->family != AF_UNSPEC
+			|| filter->global || filter->prefix_only)
+		return filter;
+
+	return NULL;
+}
+
+static void respond(struct conn *const conn, const int64_t now,
+		    const struct request *const req)
+{
+	const _Bool subscribe = req->subscribe;
+	struct snapshot *snap;
+
+	++counters[subscribe ? M_SUBSCRIBED : M_FRAMED];
+
+	if (subscribe) {
+		conn->state = CONN_SUBSCRIBED;
+		list_append(&subscribed, conn, now);
+	}
+	else {
+		conn->state = CONN_RESPONSE;
+		list_append(&responding, conn, now);
+	}
+
+	snap = get_response(conn->format, conn->filter);
+
+	if (subscribe)
+		conn->last = snapshot_get(snap);
+
+	if (req->conditional && req->etag == snap->etag) {
+		snap = snapshot_notmod(snap);
+		if (queue_output(conn, snap, 1))
+			send_conn(conn);
+		snapshot_put(snap);
+		return;
+	}
+
+	if (queue_output(conn, snap, 1))
+		send_conn(conn);
+}
+
+static void parse_request(struct conn *const conn, char *const line,
+			  const int64_t now)
+{
+	struct request req;
+
+	if (++conn->requests > 1)
+		++counters[M_PERSISTED];
+
+	if (!parse_request_line(line, &req, 0)) {
+		respond_error(conn, now, "%s", req.error);
+		return;
+	}
+
+	conn->format = req.format;
+	conn->persist = req.persist && persist_idle > 0
+			&& conn->requests < persist_max;
+
+	/* A persistent connection's previous request may have had one */
+	free(conn->filter);
+	conn->filter = NULL;
+
+	if (request_filter(&req) != NULL) {
+
+		if ((conn->filter = malloc(sizeof *conn->filter)) == NULL) {
+			error("malloc: %m\n");
+			abort();
+		}
+
+		memcpy(conn->filter, &req.filter, sizeof req.filter);
+	}
+
+	respond(conn, now, &req);
+}
+
+/* Answers the first complete request line, keeping anything after it */
+static void take_request(struct conn *const conn, char *const nl,
+			 const int64_t now)
+{
+	char line[REQUEST_MAX];
+	size_t len;
+
+	len = nl - conn->req;
+	memcpy(line, conn->req, len);
+	line[len] = 0;
+
+	conn->req_len -= len + 1;
+	memmove(conn->req, nl + 1, conn->req_len);
+	conn->req[conn->req_len] = 0;
+
+	if (conn->state == CONN_IDLE)
+		conn->accepted = now_us();
+
+	parse_request(conn, line, now);
+}
+
+static void read_request(struct conn *const conn, const int64_t now)
+{
+	ssize_t ret;
+	size_t len;
+	char *nl;
+
+	while (1) {
+
+		/* Possibly sent along with the previous one (persist) */
+		if ((nl = memchr(conn->req, '\n', conn->req_len)) != NULL) {
+			take_request(conn, nl, now);
+			return;
+		}
+
+		if (conn->req_len == sizeof conn->req - 1) {
+			respond_error(conn, now, "Request too long\n");
+			return;
+		}
+
+		ret = recv(conn->fd, conn->req + conn->req_len,
+			   sizeof conn->req - conn->req_len - 1, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				/* Nothing buffered now (see send_conn) */
+				set_events(conn, EPOLLIN | EPOLLRDHUP);
+				return;
+			}
+			warn("recv: %m\n");
+			close_conn(conn);
+			return;
+		}
+
+		/* A client that shuts down its side without a request */
+		if (ret == 0) {
+			if (conn->req_len == 0 && conn->state == CONN_REQUEST)
+				respond_legacy(conn, now);
+			else
+				close_conn(conn);
+			return;
+		}
+
+		conn->req_len += ret;
+		conn->req[conn->req_len] = 0;
+
+		/* Not a request, so not worth waiting for (see Connections) */
+		len = conn->req_len < sizeof REQUEST_MAGIC - 1
+				? conn->req_len : sizeof REQUEST_MAGIC - 1;
+		if (conn->state == CONN_REQUEST
+				&& memcmp(conn->req, REQUEST_MAGIC, len) != 0) {
+			respond_legacy(conn, now);
+			return;
+		}
+	}
+}
+
+/* Subscribers aren't expected to send anything; just detect EOF */
+static void read_subscriber(struct conn *const conn)
+{
+	char buf[REQUEST_MAX];
+	ssize_t ret;
+
+	while (1) {
+
+		ret = recv(conn->fd, buf, sizeof buf, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return;
+			warn("recv: %m\n");
+			close_conn(conn);
+			return;
+		}
+
+		if (ret == 0) {
+			close_conn(conn);
+			return;
+		}
+	}
+}
+
+static void conn_event(struct conn *const conn, const uint32_t events,
+		       const int64_t now)
+{
+	if (conn->fd < 0)
+		return;
+
+	switch (conn->state) {
+
+		case CONN_REQUEST:
+		case CONN_IDLE:
+			read_request(conn, now);
+			break;
+
+		case CONN_RESPONSE:
+			send_conn(conn);
+			break;
+
+		case CONN_SUBSCRIBED:
+			if ((events & EPOLLOUT) && !send_conn(conn))
+				break;
+			if (events & ~EPOLLOUT)
+				read_subscriber(conn);
+			break;
+	}
+}
+
+static void publish(const int64_t now __attribute__((unused)))
+{
+	struct conn *conn, *next;
+	struct snapshot *snap;
+
+	for (conn = subscribed.head; conn != NULL; conn = next) {
+
+		next = conn->next;
+		snap = get_response(conn->format, conn->filter);
+
+		/* A change that this subscriber's filter hides */
+		if (conn->last->len == snap->len
+				&& memcmp(conn->last->data, snap->data,
+					  snap->len) == 0)
+			continue;
+
+		snapshot_put(conn->last);
+		conn->last = snapshot_get(snap);
+
+		if (queue_output(conn, snap, 1))
+			send_conn(conn);
+	}
+}
+
+static struct conn *new_conn(const int fd, const enum conn_state state,
+			     const uint32_t events, struct conn_list *const list,
+			     const int64_t now)
+{
+	struct epoll_event ev;
+	struct conn *conn;
+
+	if ((conn = calloc(1, sizeof *conn)) == NULL) {
+		error("calloc: %m\n");
+		abort();
+	}
+
+	conn->fd = fd;
+	conn->state = state;
+	conn->events = events;
+
+	ev.events = conn->events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		error("epoll_ctl: %m\n");
+		abort();
+	}
+
+	list_append(list, conn, now);
+	++conn_count;
+
+	return conn;
+}
+
+static void start_conn(const int fd, const int64_t now)
+{
+	struct conn *conn;
+
+	conn = new_conn(fd, CONN_REQUEST, EPOLLIN | EPOLLRDHUP, &requesting,
+			now);
+	conn->accepted = now_us();
+	++counters[M_ACCEPTED];
+
+	/* The request may well have arrived along with the handshake */
+	read_request(conn, now);
+}
+
+static void accept_conns(const int listen_fd, const int64_t now)
+{
+	union sockaddr_inX sockaddr;
+	socklen_t addrlen;
+	int fd;
+
+	while (1) {
+
+		addrlen = sizeof sockaddr;
+		fd = accept4(listen_fd, &sockaddr.a, &addrlen,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+
+			switch (errno) {
+
+				case EAGAIN:
+					return;
+
+				case EINTR:
+				case ECONNABORTED:
+				case EPROTO:
+					continue;
+
+				case EMFILE:
+				case ENFILE:
+				case ENOBUFS:
+				case ENOMEM:
+					/* Leave the rest in the queue */
+					warn("accept4: %m\n");
+					return;
+
+				default:
+					error("accept4: %m\n");
+					abort();
+			}
+		}
+
+		if (verbose)
+			log_conn(&sockaddr);
+
+		start_conn(fd, now);
+	}
+}
+
+static void expire_conns(const int64_t now)
+{
+	struct conn *conn;
+
+	while ((conn = requesting.head) != NULL && conn->deadline <= now) {
+		if (conn->req_len == 0) {
+			respond_legacy(conn, now);
+		}
+		else {
+			warn("Incomplete request; dropping connection\n");
+			++counters[M_TIMEOUTS];
+			close_conn(conn);
+		}
+	}
+
+	while ((conn = responding.head) != NULL && conn->deadline <= now) {
+		warn("Connection timed out (%zu bytes unsent)\n",
+		     conn->pending);
+		++counters[M_TIMEOUTS];
+		close_conn(conn);
+	}
+
+	while ((conn = idle.head) != NULL && conn->deadline <= now) {
+		dbug("Persistent connection idle; closing\n");
+		close_conn(conn);
+	}
+
+	while ((conn = subscribed.head) != NULL && conn->deadline <= now) {
+
+		if (conn->pending > 0 && conn->total_sent == conn->stalled) {
+			warn("Subscriber not reading; dropping connection\n");
+			++counters[M_DROPPED];
+			close_conn(conn);
+			continue;
+		}
+
+		conn->stalled = conn->total_sent;
+		list_append(&subscribed, conn, now);
+
+		if (queue_output(conn, ping, 1))
+			send_conn(conn);
+	}
+}
+
+static int next_timeout(const int64_t now)
+{
+	struct conn_list *const lists[] = {
+		&requesting, &responding, &subscribed, &idle
+	};
+	int64_t deadline;
+	unsigned i;
+
+	deadline = INT64_MAX;
+
+	for (i = 0; i < sizeof lists / sizeof lists[0]; ++i) {
+		if (lists[i]->head != NULL && lists[i]->head->deadline < deadline)
+			deadline = lists[i]->head->deadline;
+	}
+
+	if (deadline == INT64_MAX)
+		return -1;
+
+	return deadline > now ? (int)(deadline - now) : 0;
+}
+
+/*
+ *	UDP queries
+ *
+ *	A query is a single datagram containing a request line (see
+ *	Connections), which must include a nonce:
+ *
+ *		DENAT/1 nonce=<1-32 alphanumeric characters> [option ...]
+ *
+ *	The line may be followed by a newline and padding (anything, up to
+ *	UDP_PAYLOAD_MAX bytes in all), which is ignored.
+ *
+ *	The reply is a single framed response, with the nonce echoed back
+ *	(before len=), so a client can discard spoofed or stale replies.  The
+ *	subscribe option isn't supported.  If the response doesn't fit in
+ *	UDP_PAYLOAD_MAX bytes, the reply has TOOBIG status and an empty body,
+ *	and the client should ask again over TCP -- unless it's a NOTMOD
+ *	reply to a conditional query (if-none-match=), which always fits.
+ *
+ *	A reply is never bigger than the query, so that denatd can't be used
+ *	to amplify a flood at a spoofed source address.  A response that
+ *	would fit in UDP_PAYLOAD_MAX but not in the query also gets TOOBIG,
+ *	and no reply at all is sent if even that (or ERROR or NOTMOD) is
+ *	bigger than the query.  Clients should pad their queries to
+ *	UDP_PAYLOAD_MAX bytes (as denatc does).
+ *
+ *	Queries are received and answered in batches, so a burst of them is
+ *	handled with a few system calls.
+ */
+
+#define UDP_BATCH		32
+#define UDP_ROUNDS		4	/* batches per wakeup */
+#define UDP_PAYLOAD_MAX		1232	/* fits in the IPv6 minimum MTU */
+
+struct query {
+	union sockaddr_inX addr;
+	char req[UDP_PAYLOAD_MAX + 1];	/* request line and padding */
+	char hdr[REQUEST_MAX + 128];	/* or the whole ERROR reply */
+	struct iovec iov[2];
+	struct snapshot *snap;		/* reference held until sent */
+};
+
+static __thread struct query queries[UDP_BATCH];
+static __thread struct mmsghdr udp_in[UDP_BATCH];
+static __thread struct mmsghdr udp_out[UDP_BATCH];
+
+/* Likewise for UDP sockets */
+static __thread int *udp_fds;
+
+static void answer_query(struct query *const q, struct mmsghdr *const out,
+			 const size_t len, const _Bool truncated)
+{
+	struct snapshot *snap;
+	struct request req;
+	size_t reply;
+	char *nl;
+	int ret;
+
+	q->req[len] = 0;
+	++counters[M_UDP_QUERIES];
+
+	/* Ignore any padding */
+	if ((nl = memchr(q->req, '\n', len)) != NULL)
+		*nl = 0;
+
+	if (truncated || strlen(q->req) >= REQUEST_MAX) {
+		/* The nonce can't be trusted; don't bother replying */
+		dbug("UDP query too long\n");
+		++counters[M_UDP_REJECTED];
+		return;
+	}
+
+	if (!parse_request_line(q->req, &req, 1)) {
+		dbug("Request error: %s", req.error);
+		++counters[M_UDP_REJECTED];
+		if (req.nonce == NULL)
+			return;
+		ret = snprintf(q->hdr, sizeof q->hdr,
+			       "DENAT/%d ERROR nonce=%s len=%zu\n%s",
+			       PROTO_VERSION, req.nonce, strlen(req.error),
+			       req.error);
+		q->iov[0].iov_base = q->hdr;
+		q->iov[0].iov_len = ret;
+		out->msg_hdr.msg_iovlen = 1;
+		return;
+	}
+
+	snap = get_response(req.format, request_filter(&req));
+
+	/* However big the response */
+	if (req.conditional && req.etag == snap->etag) {
+		++counters[M_NOT_MODIFIED];
+		ret = snprintf(q->hdr, sizeof q->hdr,
+			       "DENAT/%d NOTMOD gen=%" PRIu64 " etag=%016"
+			       PRIx64 " nonce=%s len=0\n", PROTO_VERSION,
+			       snap->generation, snap->etag, req.nonce);
+		q->iov[0].iov_base = q->hdr;
+		q->iov[0].iov_len = ret;
+		out->msg_hdr.msg_iovlen = 1;
+		return;
+	}
+
+	reply = snap->hdr_len + strlen(req.nonce) + 7 + snap->len;
+	if (reply > UDP_PAYLOAD_MAX || reply > len) {
+		++counters[M_UDP_TOOBIG];
+		ret = snprintf(q->hdr, sizeof q->hdr,
+			       "DENAT/%d TOOBIG gen=%" PRIu64
+			       " nonce=%s len=0\n", PROTO_VERSION,
+			       generation, req.nonce);
+		q->iov[0].iov_base = q->hdr;
+		q->iov[0].iov_len = ret;
+		out->msg_hdr.msg_iovlen = 1;
+		return;
+	}
+
+	ret = snprintf(q->hdr, sizeof q->hdr, "%.*s nonce=%s%s",
+		       (int)snap->hdr_opts, snap->hdr, req.nonce,
+		       snap->hdr + snap->hdr_opts);
+
+	/* get_response may free snapshots before the batch is sent */
+	q->snap = snapshot_get(snap);
+	q->iov[0].iov_base = q->hdr;
+	q->iov[0].iov_len = ret;
+	q->iov[1].iov_base = snap->data;
+	q->iov[1].iov_len = snap->len;
+	out->msg_hdr.msg_iovlen = 2;
+}
+
+static void send_replies(const int udp_fd, const unsigned count)
+{
+	unsigned sent;
+	int ret;
+
+	sent = 0;
+
+	while (sent < count) {
+
+		ret = sendmmsg(udp_fd, udp_out + sent, count - sent, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == ENOBUFS) {
+				warn("sendmmsg: %m; dropping %u replies\n",
+				     count - sent);
+				return;
+			}
+			/* Probably an unreachable client; skip its reply */
+			dbug("sendmmsg: %m\n");
+			++sent;
+			continue;
+		}
+
+		sent += ret;
+	}
+}
+
+static void udp_event(const int udp_fd)
+{
+	unsigned round, i, count;
+	struct query *q;
+	size_t reply;
+	int n;
+
+	for (round = 0; round < UDP_ROUNDS; ++round) {
+
+		for (i = 0; i < UDP_BATCH; ++i) {
+			q = &queries[i];
+			q->iov[0].iov_base = q->req;
+			q->iov[0].iov_len = sizeof q->req - 1;
+			memset(&udp_in[i], 0, sizeof udp_in[i]);
+			udp_in[i].msg_hdr.msg_name = &q->addr;
+			udp_in[i].msg_hdr.msg_namelen = sizeof q->addr;
+			udp_in[i].msg_hdr.msg_iov = q->iov;
+			udp_in[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		n = recvmmsg(udp_fd, udp_in, UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				warn("recvmmsg: %m\n");
+			return;
+		}
+
+		count = 0;
+
+		for (i = 0; i < (unsigned)n; ++i) {
+
+			q = &queries[i];
+
+			if (verbose)
+				log_conn(&q->addr);
+
+			memset(&udp_out[count], 0, sizeof udp_out[count]);
+			udp_out[count].msg_hdr.msg_name = &q->addr;
+			udp_out[count].msg_hdr.msg_namelen =
+						udp_in[i].msg_hdr.msg_namelen;
+			udp_out[count].msg_hdr.msg_iov = q->iov;
+
+			q->snap = NULL;
+			answer_query(q, &udp_out[count], udp_in[i].msg_len,
+				     udp_in[i].msg_hdr.msg_flags & MSG_TRUNC);
+
+			if (udp_out[count].msg_hdr.msg_iovlen == 0)
+				continue;
+
+			/* No amplification (see above) */
+			reply = q->iov[0].iov_len;
+			if (udp_out[count].msg_hdr.msg_iovlen > 1)
+				reply += q->iov[1].iov_len;
+			if (reply > udp_in[i].msg_len) {
+				dbug("UDP query not padded; ignoring\n");
+				++counters[M_UDP_UNPADDED];
+				continue;
+			}
+
+			++count;
+		}
+
+		send_replies(udp_fd, count);
+
+		for (i = 0; i < (unsigned)n; ++i)
+			snapshot_put(queries[i].snap);
+
+		if (n < UDP_BATCH)
+			return;
+	}
+}
+
+/*
+ *	Metrics socket
+ *
+ *	Every connection to the metrics socket (-m|--metrics) gets a snapshot
+ *	of the metrics, in Prometheus text format, and is then closed.
+ */
+
+#define METRICS_PREFIX		"denatd_"
+
+/* Used as the epoll data pointer for the metrics socket */
+static int metrics_fd = -1;
+
+static void metric_counter(struct buffer *const b, const char *const name,
+			   const char *const help, const uint64_t value)
+{
+	bprintf(b, "# HELP " METRICS_PREFIX "%s_total %s\n"
+		   "# TYPE " METRICS_PREFIX "%s_total counter\n"
+		   METRICS_PREFIX "%s_total %" PRIu64 "\n",
+		name, help, name, name, value);
+}
+
+static void metric_gauge(struct buffer *const b, const char *const name,
+			 const char *const help, const uint64_t value)
+{
+	bprintf(b, "# HELP " METRICS_PREFIX "%s %s\n"
+		   "# TYPE " METRICS_PREFIX "%s gauge\n"
+		   METRICS_PREFIX "%s %" PRIu64 "\n",
+		name, help, name, name, value);
+}
+
+static void render_histogram(struct buffer *const b, const enum histogram h,
+			     const struct hist *const hist)
+{
+	const char *const name = histogram_info[h].name;
+	const _Bool usecs = histogram_info[h].usecs;
+	uint64_t cumulative;
+	unsigned i;
+
+	bprintf(b, "# HELP " METRICS_PREFIX "%s %s\n"
+		   "# TYPE " METRICS_PREFIX "%s histogram\n",
+		name, histogram_info[h].help, name);
+
+	cumulative = 0;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		cumulative += hist->buckets[i];
+		bprintf(b, METRICS_PREFIX "%s_bucket{le=\"%g\"} %" PRIu64 "\n",
+			name, usecs ? (double)(1 << i) / 1000000 : 1 << i,
+			cumulative);
+	}
+
+	bprintf(b, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n",
+		name, hist->count);
+
+	if (usecs) {
+		bprintf(b, METRICS_PREFIX "%s_sum %.6f\n", name,
+			(double)hist->sum / 1000000);
+	}
+	else {
+		bprintf(b, METRICS_PREFIX "%s_sum %" PRIu64 "\n", name,
+			hist->sum);
+	}
+
+	bprintf(b, METRICS_PREFIX "%s_count %" PRIu64 "\n", name,
+		hist->count);
+}
+
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/*
+ * Adds up every worker's metrics.  Other workers may update theirs meanwhile,
+ * so the totals aren't an exact point-in-time view.
+ */
+static void sum_metrics(uint64_t *const ctrs, struct hist *const hists,
+			unsigned *const conns, unsigned *const subscribers)
+{
+	const struct hist *hist;
+	const struct worker *w;
+	enum histogram h;
+	enum counter c;
+	unsigned i;
+
+	memset(ctrs, 0, M_COUNT * sizeof *ctrs);
+	memset(hists, 0, H_COUNT * sizeof *hists);
+	*conns = *subscribers = 0;
+
+	for (w = workers; w < workers + num_workers; ++w) {
+
+		/* Not started yet */
+		if (__atomic_load_n(&w->counters, __ATOMIC_ACQUIRE) == NULL)
+			continue;
+
+		for (c = 0; c < M_COUNT; ++c)
+			ctrs[c] += LOAD(w->counters[c]);
+
+		for (h = 0; h < H_COUNT; ++h) {
+			hist = &w->histograms[h];
+			for (i = 0; i < HIST_BUCKETS; ++i)
+				hists[h].buckets[i] += LOAD(hist->buckets[i]);
+			hists[h].count += LOAD(hist->count);
+			hists[h].sum += LOAD(hist->sum);
+		}
+
+		*conns += LOAD(*w->conn_count);
+		*subscribers += LOAD(*w->subscribers);
+	}
+}
+
+/*
+ * Packets the kernel dropped on the TCP (listening) or UDP sockets, which
+ * includes those dropped by the client filter (see Client filter), as well as
+ * any that didn't fit in a full accept or receive queue.  Inherited sockets
+ * are shared by every worker.
+ */
+static uint64_t socket_drops(const _Bool tcp)
+{
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	const struct worker *w;
+	unsigned i, num_fds;
+	uint64_t drops;
+	socklen_t len;
+	int fd;
+
+	num_fds = tcp ? num_tcp_fds : num_udp_fds;
+	drops = 0;
+
+	for (w = workers; w < workers + (inherited ? 1 : num_workers); ++w) {
+
+		for (i = 0; i < num_fds; ++i) {
+
+			fd = tcp ? w->listen_fds[i] : w->udp_fds[i];
+			len = sizeof meminfo;
+
+			if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo,
+				       &len) < 0) {
+				warn("getsockopt(SO_MEMINFO): %m\n");
+				continue;
+			}
+
+			drops += meminfo[SK_MEMINFO_DROPS];
+		}
+	}
+
+	return drops;
+}
+
+static void render_metrics(struct buffer *const b)
+{
+	struct hist hists[H_COUNT];
+	uint64_t ctrs[M_COUNT];
+	unsigned conns, subscribers;
+	enum histogram h;
+	enum counter c;
+
+	sum_metrics(ctrs, hists, &conns, &subscribers);
+
+	for (c = 0; c < M_COUNT; ++c) {
+		metric_counter(b, counter_info[c].name, counter_info[c].help,
+			       ctrs[c]);
+	}
+
+	metric_counter(b, "listen_drops", "Packets dropped by the listening "
+		       "sockets (by -A|--allow, or with the accept queue full)",
+		       socket_drops(1));
+	metric_counter(b, "udp_drops", "Datagrams dropped by the UDP sockets "
+		       "(by -A|--allow, or with the receive queue full)",
+		       socket_drops(0));
+
+	metric_gauge(b, "connections", "Open connections", conns);
+	metric_gauge(b, "subscribers", "Subscribed connections", subscribers);
+	metric_gauge(b, "cache_interfaces", "Interfaces in the cache",
+		     cache.num_ifaces);
+	metric_gauge(b, "cache_addresses", "Addresses in the cache",
+		     cache.num_addrs);
+	metric_gauge(b, "cache_routes", "Candidate prefix routes in the cache",
+		     cache.num_routes);
+	metric_gauge(b, "response_generation", "Generation of the response",
+		     generation);
+
+	metric_gauge(b, "workers", "Worker threads", num_workers);
+
+	for (h = 0; h < H_COUNT; ++h)
+		render_histogram(b, h, &hists[h]);
+}
+
+static void serve_metrics(const int fd, const int64_t now)
+{
+	static struct buffer buf;
+	struct snapshot *snap;
+	struct conn *conn;
+
+	breset(&buf);
+	render_metrics(&buf);
+	snap = snapshot_new(buf.data, buf.len, "DENAT/%d METRICS",
+			    PROTO_VERSION);
+
+	conn = new_conn(fd, CONN_RESPONSE, EPOLLOUT, &responding, now);
+
+	if (queue_output(conn, snap, 0))
+		send_conn(conn);
+
+	snapshot_put(snap);
+}
+
+static void metrics_event(const int64_t now)
+{
+	int fd;
+
+	while (1) {
+
+		fd = accept4(metrics_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN)
+				warn("accept4: %m\n");
+			return;
+		}
+
+		serve_metrics(fd, now);
+	}
+}
+
+static void get_metrics_socket(void)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+
+	metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    0);
+	if (metrics_fd < 0) {
+		error("socket: %m\n");
+		abort();
+	}
+
+	/* Remove a socket left behind by a previous instance */
+	if (lstat(metrics_path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			error("%s exists and is not a socket\n", metrics_path);
+			abort();
+		}
+		if (unlink(metrics_path) < 0) {
+			error("unlink: %s: %m\n", metrics_path);
+			abort();
+		}
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, metrics_path);
+
+	if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		error("bind: %s: %m\n", metrics_path);
+		abort();
+	}
+
+	if (listen(metrics_fd, 16) < 0) {
+		error("listen: %m\n");
+		abort();
+	}
+
+	info("Metrics available on %s\n", metrics_path);
+}
 
-	if (mnl_attr_parse(nlh, sizeof *rm, attr_cb, &addr) < 0) {
-		error("mnl_attr_parse: %m\n");
-		abort();
+/*
+ *	Re-executing (see Restarts)
+ */
+
+/* Saved at startup, since the binary may be replaced (e.g. by an upgrade) */
+static char exe_path[PATH_MAX];
+static char **exe_argv;
+
+/* Used as the epoll data pointer for the signalfd (main thread) */
+static int signal_fd = -1;
+
+/* Set by the main thread; every worker then drains */
+static _Bool restarting = 0;
+static _Bool cold_restart = 0;
+
+static __thread _Bool draining = 0;
+
+/* Must be called before any other threads are started */
+static void get_signals(char *argv[])
+{
+	sigset_t mask;
+	ssize_t len;
+
+	exe_argv = argv;
+
+	len = readlink("/proc/self/exe", exe_path, sizeof exe_path - 1);
+	if (len < 0) {
+		warn("readlink: /proc/self/exe: %m\n");
+		len = 0;
 	}
+	exe_path[len] = 0;
 
-	if (addr == NULL) {
-		warn("Ignoring route with no destination\n");
-		return MNL_CB_OK;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR2);
+	pthread_check(pthread_sigmask(SIG_BLOCK, &mask, NULL),
+		      "pthread_sigmask");
+
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		error("signalfd: %m\n");
+		abort();
 	}
+}
 
-	switch (rm->rtm_dst_len) {
+static void signal_event(void)
+{
+	static const uint64_t one = 1;
+	struct signalfd_siginfo si;
+	unsigned i;
 
-		case 48:
-		case 52:
-		case 56:
-			break;
+	while (1) {
+
+		if (read(signal_fd, &si, sizeof si) < 0) {
+			if (errno == EAGAIN)
+				return;
+			if (errno == EINTR)
+				continue;
+			error("read: %m\n");
+			abort();
+		}
+
+		if (restarting)
+			continue;
+
+		/* Better to keep running than to exec nothing */
+		if (access(exe_path, X_OK) < 0) {
+			warn("Not restarting: %s: %m\n", exe_path);
+			continue;
+		}
+
+		cold_restart = (si.ssi_signo == SIGUSR2);
+		info("Restarting on %s\n",
+		     cold_restart ? "SIGUSR2 (rebuilding cache)" : "SIGHUP");
+
+		__atomic_store_n(&restarting, 1, __ATOMIC_RELEASE);
+
+		for (i = 1; i < num_workers; ++i) {
+			if (write(workers[i].notify_fd, &one, sizeof one) < 0) {
+				error("write: %m\n");
+				abort();
+			}
+		}
+	}
+}
 
-		default:
-			warn("Ignoring route with unsupported prefix length "
-			      "(%" PRIu8 ")\n", rm->rtm_dst_len);
-			return MNL_CB_OK;
+static void epoll_del(const int fd)
+{
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+		error("epoll_ctl: %m\n");
+		abort();
 	}
+}
+
+/* Returns 1 once the worker has nothing left to do before the restart */
+static _Bool drain(void)
+{
+	unsigned i;
+
+	/* Leave new clients queued for the new image */
+	if (!draining) {
+
+		for (i = 0; i < num_tcp_fds; ++i)
+			epoll_del(listen_fds[i]);
+
+		for (i = 0; i < num_udp_fds; ++i)
+			epoll_del(udp_fds[i]);
 
-	if (prefix->dst != NULL) {
-		warn("Multiple valid routes found; ignoring all\n");
-		prefix->dst = NULL;
-		prefix->len = 0;
-		return MNL_CB_STOP;
+		if (main_thread && metrics_fd >= 0)
+			epoll_del(metrics_fd);
+
+		draining = 1;
 	}
 
-	prefix->dst = addr;
-	prefix->len = rm->rtm_dst_len;
+	/* They reconnect (to the new image) */
+	while (subscribed.head != NULL)
+		close_conn(subscribed.head);
+	while (idle.head != NULL)
+		close_conn(idle.head);
 
-	return MNL_CB_OK;
+	return requesting.head == NULL && responding.head == NULL;
 }
 
-static void get_prefix(struct mnl_socket *const mnl)
+/* Moves fds to SD_LISTEN_FDS_START and up, without close-on-exec */
+static void pass_fds(int *const fds, const size_t count)
 {
-	uint8_t msg[MNL_SOCKET_BUFFER_SIZE];
-	char buf[INET6_ADDRSTRLEN];
-	struct prefix prefix;
-	struct nlmsghdr *nlh;
-	struct rtmsg *rtm;
-	unsigned portid;
-	ssize_t ret;
-	time_t seq;
+	size_t i;
+
+	/* Some of the targets may be in use, even by the fds themselves */
+	for (i = 0; i < count; ++i) {
+		fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC,
+			       SD_LISTEN_FDS_START + count);
+		if (fds[i] < 0) {
+			error("fcntl: %m\n");
+			abort();
+		}
+	}
 
-	nlh = mnl_nlmsg_put_header(msg);
-	nlh->nlmsg_type = RTM_GETROUTE;
-	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
-	nlh->nlmsg_seq = time(&seq);
-	rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
-	rtm->rtm_family = AF_INET6;
-	portid = mnl_socket_get_portid(mnl);
+	for (i = 0; i < count; ++i) {
+		if (dup2(fds[i], SD_LISTEN_FDS_START + i) < 0) {
+			error("dup2: %m\n");
+			abort();
+		}
+	}
+}
 
-	if (mnl_socket_sendto(mnl, nlh, nlh->nlmsg_len) < 0) {
-		error("mnl_socket_sendto: %m\n");
+static void set_env(const char *const name, const long value)
+{
+	char buf[24];
+
+	snprintf(buf, sizeof buf, "%ld", value);
+
+	if (setenv(name, buf, 1) < 0) {
+		error("setenv: %m\n");
 		abort();
 	}
+}
 
-	prefix.dst = NULL;
-	prefix.len = 0;
+static int *add_fd(int *fds, size_t *const count, size_t *const max,
+		   const int fd)
+{
+	fds = grow(fds, max, *count, sizeof *fds);
+	fds[(*count)++] = fd;
 
-	do {
-		if ((ret = mnl_socket_recvfrom(mnl, msg, sizeof msg)) < 0) {
-			error("mnl_socket_recvfrom: %m\n");
-			abort();
+	return fds;
+}
+
+/* Called by the main thread, once it has drained */
+__attribute__((noreturn))
+static void restart(void)
+{
+	struct buffer buf = { 0 };
+	size_t i, num_fds, max_fds, num_listen;
+	struct worker *w;
+	struct state st;
+	int *fds, fd;
+
+	/* The other workers are only started along with the cache */
+	if (mnl != NULL) {
+		for (w = workers + 1; w < workers + num_workers; ++w) {
+			pthread_check(pthread_join(w->thread, NULL),
+				      "pthread_join");
 		}
+	}
 
-		if (ret == 0)
-			break;
+	fds = NULL;
+	num_fds = max_fds = 0;
 
-		ret = mnl_cb_run(msg, ret, seq, portid, msg_cb, &prefix);
-		if (ret < 0) {
-			error("mnl_cb_run: %m\n");
-			abort();
+	/* Every worker's own sockets, or the shared inherited ones */
+	if (inherited) {
+		for (i = 0; i < num_inherited_tcp; ++i)
+			fds = add_fd(fds, &num_fds, &max_fds, inherited_tcp[i]);
+		for (i = 0; i < num_inherited_udp; ++i)
+			fds = add_fd(fds, &num_fds, &max_fds, inherited_udp[i]);
+	}
+	else {
+		for (w = workers; w < workers + num_workers; ++w) {
+			for (i = 0; i < num_tcp_fds; ++i) {
+				fds = add_fd(fds, &num_fds, &max_fds,
+					     w->listen_fds[i]);
+			}
+			for (i = 0; i < num_udp_fds; ++i) {
+				fds = add_fd(fds, &num_fds, &max_fds,
+					     w->udp_fds[i]);
+			}
 		}
 	}
-	while (ret > 0);
 
-	if (prefix.dst == NULL)
-		return;
+	num_listen = num_fds;
+
+	/* The state memfd follows the listening sockets, then netlink */
+	memset(&st, 0, sizeof st);
+	memcpy(st.magic, STATE_MAGIC, sizeof st.magic);
+	st.generation = generation;
+	st.saved = time(NULL);
+	st.netlink_fd = -1;
+	st.rtproto = rtproto;
+	st.activated = activated;
+
+	if (mnl != NULL && !cold_restart) {
+		/* Only notifications after this are left queued */
+		cache_update();
+		st.netlink_fd = SD_LISTEN_FDS_START + num_listen + 1;
+	}
 
-	if (inet_ntop(AF_INET6, prefix.dst, buf, sizeof buf) == NULL) {
-		error("inet_ntop: %m\n");
+	breset(&buf);
+	bput(&buf, &st, sizeof st);
+	if (st.netlink_fd >= 0)
+		cache_save(&buf, st.saved);
+
+	if ((fd = memfd_create("denatd-state", MFD_CLOEXEC)) < 0) {
+		error("memfd_create: %m\n");
 		abort();
 	}
 
-	if (bprintf("__PREFIX__ %s/%" PRIu8 "\n", buf, prefix.len))
-		warn("Output truncated\n");
+	write_all(fd, buf.data, buf.len, "restart state");
+	fds = add_fd(fds, &num_fds, &max_fds, fd);
+	if (st.netlink_fd >= 0) {
+		fds = add_fd(fds, &num_fds, &max_fds,
+			     mnl_socket_get_fd(mnl));
+	}
+
+	info("Executing %s (%zu bytes of state)\n", exe_path, buf.len);
+
+	/* The syslog socket's fd may be about to be reused */
+	closelog();
+
+	pass_fds(fds, num_fds);
+
+	set_env("LISTEN_PID", getpid());
+	set_env("LISTEN_FDS", num_listen);
+	set_env("DENATD_STATE", SD_LISTEN_FDS_START + num_listen);
+	unsetenv("LISTEN_FDNAMES");
+
+	execv(exe_path, exe_argv);
+
+	error("execv: %s: %m\n", exe_path);
+	abort();
 }
 
-static struct mnl_socket *get_netlink(void)
+static void epoll_add(const int fd, void *const ptr, const uint32_t events)
 {
-	struct mnl_socket *mnl;
+	struct epoll_event ev;
 
-	if ((mnl = mnl_socket_open(NETLINK_ROUTE)) == NULL) {
-		error("mnl_socket_open: %m\n");
+	ev.events = events;
+	ev.data.ptr = ptr;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		error("epoll_ctl: %m\n");
 		abort();
 	}
+}
 
-	if (mnl_socket_bind(mnl, 0, MNL_SOCKET_AUTOPID) < 0) {
-		error("mnl_socket_bind: %m\n");
+/* Only the main thread handles netlink (see start_cache), metrics & signals */
+static void get_epoll(void)
+{
+	uint32_t events;
+	unsigned i;
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		error("epoll_create1: %m\n");
 		abort();
 	}
 
-	return mnl;
+	/* Inherited sockets are shared; only wake one worker for each */
+	events = EPOLLIN;
+	if (inherited && num_workers > 1)
+		events |= EPOLLEXCLUSIVE;
+
+	for (i = 0; i < num_tcp_fds; ++i)
+		epoll_add(listen_fds[i], &listen_fds[i], events);
+
+	for (i = 0; i < num_udp_fds; ++i)
+		epoll_add(udp_fds[i], &udp_fds[i], events);
+
+	if (notify_fd >= 0)
+		epoll_add(notify_fd, &notify_fd, EPOLLIN);
+
+	if (main_thread && metrics_fd >= 0)
+		epoll_add(metrics_fd, &metrics_fd, EPOLLIN);
+
+	if (main_thread && signal_fd >= 0)
+		epoll_add(signal_fd, &signal_fd, EPOLLIN);
 }
 
-static int get_socket(void)
+/*
+ *	Worker threads (see Workers)
+ */
+
+static int *alloc_fds(const unsigned count)
 {
-	char buf[INET6_ADDRSTRLEN];
-	union sockaddr_inX addr;
-	socklen_t addrlen;
-	int fd;
+	int *fds;
 
-	fd = socket(ip_version, SOCK_STREAM | SOCK_CLOEXEC, 0);
-	if (fd < 0) {
-		error("socket: %m\n");
+	if ((fds = calloc(count, sizeof *fds)) == NULL) {
+		error("calloc: %m\n");
 		abort();
 	}
 
-	if (ip_version == AF_INET) {
+	return fds;
+}
 
-		addr.in.sin_family = AF_INET;
-		addr.in.sin_port = htons(lport);
-		addr.in.sin_addr = laddr4;
-		addrlen = sizeof addr.in;
+/*
+ * Creates every worker's sockets, so any errors are reported at startup.
+ * Inherited sockets (see Socket activation) are shared by all workers
+ * instead; systemd created them as root, so denatd couldn't add sockets to
+ * their SO_REUSEPORT groups anyway.
+ */
+static void get_workers(void)
+{
+	struct worker *w;
+	unsigned i;
 
-		if (inet_ntop(AF_INET, &laddr4, buf, sizeof buf) == NULL) {
-			error("inet_ntop: %m\n");
-			abort();
-		}
+	if ((workers = calloc(num_workers, sizeof *workers)) == NULL) {
+		error("calloc: %m\n");
+		abort();
+	}
+
+	if (inherited) {
+		num_tcp_fds = num_inherited_tcp;
+		num_udp_fds = num_inherited_udp;
+		for (i = 0; i < num_tcp_fds; ++i)
+			filter_clients(inherited_tcp[i]);
+		for (i = 0; i < num_udp_fds; ++i)
+			filter_clients(inherited_udp[i]);
 	}
 	else {
-		addr.in6.sin6_family = AF_INET6;
-		addr.in6.sin6_port = htons(lport);
-		addr.in6.sin6_addr = laddr6;
-		addrlen = sizeof addr.in6;
+		num_tcp_fds = num_laddrs;
+		num_udp_fds = udp ? num_laddrs : 0;
+	}
 
-		if (inet_ntop(AF_INET6, &laddr6, buf, sizeof buf) == NULL) {
-			error("inet_ntop: %m\n");
+	for (w = workers; w < workers + num_workers; ++w) {
+
+		w->listen_fds = alloc_fds(num_tcp_fds);
+		w->udp_fds = alloc_fds(num_udp_fds);
+		w->notify_fd = -1;
+
+		if (inherited) {
+			memcpy(w->listen_fds, inherited_tcp,
+			       num_tcp_fds * sizeof *w->listen_fds);
+			memcpy(w->udp_fds, inherited_udp,
+			       num_udp_fds * sizeof *w->udp_fds);
+		}
+		else {
+			for (i = 0; i < num_tcp_fds; ++i) {
+				w->listen_fds[i] = get_socket(&laddrs[i],
+							      SOCK_STREAM,
+							      w - workers);
+			}
+			for (i = 0; i < num_udp_fds; ++i) {
+				w->udp_fds[i] = get_socket(&laddrs[i],
+							   SOCK_DGRAM,
+							   w - workers);
+			}
+		}
+
+		if (w == workers)
+			continue;
+
+		w->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (w->notify_fd < 0) {
+			error("eventfd: %m\n");
 			abort();
 		}
 	}
+}
 
-	if (bind(fd, &addr.a, addrlen) < 0) {
-		error("bind: %m\n");
-		abort();
-	}
+/* Runs a worker on the CPUs whose packets steer_by_cpu gives it */
+static void pin_worker(const unsigned index)
+{
+	cpu_set_t cpus;
+	unsigned cpu;
+	int ret;
 
-	if (listen(fd, 1) < 0) {
-		error("listen: %m\n");
-		abort();
+	CPU_ZERO(&cpus);
+	for (cpu = index; cpu < CPU_SETSIZE; cpu += num_workers)
+		CPU_SET(cpu, &cpus);
+
+	/* Failure (e.g. more workers than CPUs) just costs some locality */
+	ret = pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+	if (ret != 0) {
+		errno = ret;
+		warn("pthread_setaffinity_np: %m\n");
 	}
+}
 
-	info("Listening on %s/%" PRIu16 "\n", buf, lport);
+/* Called by each worker's own thread */
+static void start_worker(struct worker *const w)
+{
+	main_thread = (w == workers);
+	listen_fds = w->listen_fds;
+	udp_fds = w->udp_fds;
+	notify_fd = w->notify_fd;
 
-	return fd;
+	if (!main_thread)
+		sync_response();
+
+	if (cpu_steer && num_workers > 1)
+		pin_worker(w - workers);
+
+	get_epoll();
+
+	w->histograms = histograms;
+	w->conn_count = &conn_count;
+	w->subscribers = &subscribed.count;
+	__atomic_store_n(&w->counters, counters, __ATOMIC_RELEASE);
 }
 
-static void log_conn(union sockaddr_inX *addr)
+/* Builds the cache (main thread) first, if need be */
+__attribute__((noreturn))
+static void serve(void);
+
+static void *worker_main(void *const arg)
 {
-	char buf[INET6_ADDRSTRLEN];
-	uint16_t port;
-	void *src;
+	start_worker(arg);
+	serve();
+}
 
-	if (addr->a.sa_family == AF_INET) {
-		src = &addr->in.sin_addr;
-		port = ntohs(addr->in.sin_port);
-	}
-	else {
-		src = &addr->in6.sin6_addr;
-		port = ntohs(addr->in6.sin6_port);
+/*
+ * Builds the cache and starts the other workers.  Socket-activated, this is
+ * put off until the first client, so that starting denatd just to find it
+ * idle costs nothing; normally that's right away.
+ */
+static void start_cache(void)
+{
+	struct worker *w;
+
+	get_netlink();
+	epoll_add(mnl_socket_get_fd(mnl), &mnl, EPOLLIN);
+	render_response();
+
+	for (w = workers + 1; w < workers + num_workers; ++w) {
+		pthread_check(pthread_create(&w->thread, NULL, worker_main, w),
+			      "pthread_create");
 	}
 
-	if (inet_ntop(addr->a.sa_family, src, buf, sizeof buf) == NULL) {
-		error("inet_ntop: %m\n");
+	if (num_workers > 1)
+		info("Started %u workers\n", num_workers);
+}
+
+/* The response has changed (other workers) */
+static void notify_event(const int64_t now)
+{
+	uint64_t count;
+
+	if (read(notify_fd, &count, sizeof count) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		error("read: %m\n");
 		abort();
 	}
 
-	dbug("Connection from %s/%" PRIu16 "\n", buf, port);
+	sync_response();
+	publish(now);
 }
 
+/*
+ * Socket-activated, with -i|--idle-timeout, denatd exits once a whole idle
+ * timeout (so between one and two of them) has gone by without any open
+ * connections, new ones, or UDP queries.  Checked by the main thread.
+ */
+static int64_t idle_deadline = 0;
 
-int main(int argc, char *argv[])
+static void check_idle(const int64_t now)
 {
-	union sockaddr_inX sockaddr;
-	struct mnl_socket *mnl;
-	int listen_fd, sockfd;
-	socklen_t addrlen;
+	static uint64_t last_activity = 0;
+	struct hist hists[H_COUNT];
+	uint64_t ctrs[M_COUNT], activity;
+	unsigned conns, subscribers;
 
-	parse_args(argc, argv);
-	if (!debug)
-		openlog(EXEC_NAME, LOG_PID, LOG_USER);
+	if (idle_deadline == 0 || now < idle_deadline)
+		return;
 
-	listen_fd = get_socket();
-	mnl = get_netlink();
+	sum_metrics(ctrs, hists, &conns, &subscribers);
+	activity = ctrs[M_ACCEPTED] + ctrs[M_UDP_QUERIES];
 
-	while (1) {
+	if (conns == 0 && activity == last_activity) {
+		info("Idle for %" PRId64 " seconds; exiting\n",
+		     idle_timeout / 1000);
+		exit(EXIT_SUCCESS);
+	}
 
-		cursor = 0;
+	last_activity = activity;
+	idle_deadline = now + idle_timeout;
+}
 
-		addrlen = sizeof sockaddr;
-		sockfd = accept(listen_fd, &sockaddr.a, &addrlen);
-		if (sockfd < 0) {
-			error("accept: %m\n");
+static int get_timeout(const int64_t now)
+{
+	int timeout;
+
+	timeout = next_timeout(now);
+
+	if (!main_thread || idle_deadline == 0)
+		return timeout;
+
+	if (idle_deadline <= now)
+		return 0;
+
+	if (timeout < 0 || idle_deadline - now < timeout)
+		timeout = idle_deadline - now;
+
+	return timeout;
+}
+
+__attribute__((noreturn))
+static void serve(void)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int64_t now;
+	void *ptr;
+	int i, n;
+
+	while (1) {
+
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS,
+			       get_timeout(now_ms()));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			error("epoll_wait: %m\n");
 			abort();
 		}
 
-		if (verbose)
-			log_conn(&sockaddr);
+		now = now_ms();
+
+		/* Bring the cache up to date before answering anyone */
+		for (i = 0; i < n; ++i) {
+			if (events[i].data.ptr == &mnl) {
+				if (update_response())
+					publish(now);
+				events[i].data.ptr = NULL;
+			}
+			else if (events[i].data.ptr == &notify_fd) {
+				notify_event(now);
+				events[i].data.ptr = NULL;
+			}
+			else if (events[i].data.ptr == &signal_fd) {
+				signal_event();
+				events[i].data.ptr = NULL;
+			}
+		}
+
+		/* The first client of a socket-activated instance */
+		for (i = 0; i < n && mnl == NULL && !restarting; ++i) {
+			if (events[i].data.ptr != NULL)
+				start_cache();
+		}
 
-		get_ips();
-		get_prefix(mnl);
+		for (i = 0; i < n; ++i) {
 
-		if (write(sockfd, outbuf, cursor) != cursor)
-			warn("write: %m\n");
+			if (events[i].data.ptr == NULL)
+				continue;
 
-		if (close(sockfd) < 0) {
-			error("close: %m\n");
-			abort();
+			ptr = events[i].data.ptr;
+
+			if (ptr >= (void *)listen_fds
+				    && ptr < (void *)(listen_fds + num_tcp_fds)) {
+				accept_conns(*(int *)ptr, now);
+				continue;
+			}
+
+			if (ptr >= (void *)udp_fds
+				    && ptr < (void *)(udp_fds + num_udp_fds)) {
+				udp_event(*(int *)ptr);
+				continue;
+			}
+
+			if (events[i].data.ptr == &metrics_fd) {
+				metrics_event(now);
+				continue;
+			}
+
+			conn_event(events[i].data.ptr, events[i].events, now);
+		}
+
+		expire_conns(now_ms());
+		free_closed();
+
+		if (__atomic_load_n(&restarting, __ATOMIC_ACQUIRE)) {
+			if (!drain())
+				continue;
+			if (main_thread)
+				restart();
+			pthread_exit(NULL);
 		}
 
-		dbug("Connection closed\n");
+		if (main_thread)
+			check_idle(now_ms());
+	}
+}
+
+/* Builds the cache from a capture and prints the (text) response */
+__attribute__((noreturn))
+static void replay(void)
+{
+	struct capture cap;
+	const uint8_t *buf;
+	size_t offset, len;
+
+	/* The response is rendered, but never shared */
+	num_workers = 1;
+
+	capture_load(replay_path, &cap);
+
+	for (offset = 0; (buf = capture_next(&cap, &offset, &len)) != NULL; ) {
+		if (mnl_cb_run(buf, len, 0, 0, msg_cb, NULL) < 0)
+			warn("mnl_cb_run: %m\n");
+	}
+
+	dbug("Cache: %zu interfaces, %zu addresses, %zu routes\n",
+	     cache.num_ifaces, cache.num_addrs, cache.num_routes);
+
+	render_response();
+
+	if (fwrite(current[FMT_TEXT]->data, 1, current[FMT_TEXT]->len, stdout)
+				!= current[FMT_TEXT]->len || fflush(stdout) != 0) {
+		error("fwrite: %m\n");
+		abort();
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char *argv[])
+{
+	parse_args(argc, argv);
+	if (!debug)
+		openlog(EXEC_NAME, LOG_PID, LOG_USER);
+
+	if (replay_path != NULL)
+		replay();
+
+	get_inherited();
+	get_state();
+	get_workers();
+	if (metrics_path != NULL)
+		get_metrics_socket();
+	if (shm_path != NULL)
+		get_shm();
+	get_signals(argv);
+	start_worker(workers);
+
+	if (!activated) {
+		if (idle_timeout != 0)
+			warn("Not socket-activated; ignoring idle timeout\n");
+		start_cache();
+	}
+	else {
+		if (idle_timeout != 0)
+			idle_deadline = now_ms() + idle_timeout;
+		/* Restarted after the first client (see Restarts) */
+		if (restored_fd >= 0)
+			start_cache();
 	}
+
+	serve();
 }
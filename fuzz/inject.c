@@ -0,0 +1,218 @@
+/*
+ * Copyright 2019 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *	http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Error injection for denatd's cache resync.  The dumps in a capture (denatd
+ * -R|--record, or bench/parse -o) are served in place of the netlink socket,
+ * first undisturbed, and then with ENOBUFS (notifications lost) or EINTR
+ * injected before each received buffer in turn.  Every run must end with the
+ * same response as the undisturbed one; an overflow must make cache_resync
+ * dump everything again, and EINTR must not.
+ *
+ *	cc -g -O1 -pthread -fsanitize=address,undefined \
+ *		-I/path/to/libmnl/include -o inject inject.c -lmnl
+ *	./inject capture
+ */
+
+#define mnl_socket_get_fd	inject_get_fd
+#define mnl_socket_sendto	inject_sendto
+#define mnl_socket_recvfrom	inject_recvfrom
+#define main			denatd_main
+#include "../denatd.c"
+#undef main
+
+/* Link, address and route dumps, in the order cache_resync requests them */
+#define DUMPS			3
+
+struct dump {
+	size_t first;		/* index of its first buffer */
+	size_t end;		/* index after its last (NLMSG_DONE) buffer */
+};
+
+static struct {
+	const uint8_t **bufs;
+	size_t *lens;
+	size_t num_bufs;
+	struct dump dumps[DUMPS];
+	size_t next;		/* next buffer to receive */
+	size_t end;		/* end of the current dump */
+	unsigned recvs;		/* calls to inject_recvfrom */
+	unsigned requests;	/* calls to inject_sendto */
+	unsigned inject_at;	/* recvs value at which to fail (or -1) */
+	int inject_errno;
+	int fd;			/* for cache_resync's drain; always empty */
+} sim;
+
+int inject_get_fd(const struct mnl_socket *const nl __attribute__((unused)))
+{
+	return sim.fd;
+}
+
+ssize_t inject_sendto(const struct mnl_socket *const nl __attribute__((unused)),
+		      const void *const req,
+		      const size_t siz __attribute__((unused)))
+{
+	const struct nlmsghdr *const nlh = req;
+	unsigned i;
+
+	switch (nlh->nlmsg_type) {
+		case RTM_GETLINK:	i = 0;	break;
+		case RTM_GETADDR:	i = 1;	break;
+		default:		i = 2;	break;
+	}
+
+	sim.next = sim.dumps[i].first;
+	sim.end = sim.dumps[i].end;
+	++sim.requests;
+
+	return nlh->nlmsg_len;
+}
+
+ssize_t inject_recvfrom(const struct mnl_socket *const nl
+						__attribute__((unused)),
+			void *const buf, const size_t siz)
+{
+	if (sim.recvs++ == sim.inject_at) {
+		errno = sim.inject_errno;
+		return -1;
+	}
+
+	/* Nothing left would block forever on a real socket */
+	if (sim.next == sim.end) {
+		fprintf(stderr, "Read past the end of a dump\n");
+		abort();
+	}
+
+	if (sim.lens[sim.next] > siz) {
+		fprintf(stderr, "Capture buffer too big\n");
+		abort();
+	}
+
+	memcpy(buf, sim.bufs[sim.next], sim.lens[sim.next]);
+
+	return sim.lens[sim.next++];
+}
+
+/* Splits a capture into buffers, and the buffers into dumps */
+static void load(const char *const path)
+{
+	struct capture cap;
+	const uint8_t *buf;
+	size_t offset, len, n, first;
+	unsigned d;
+
+	capture_load(path, &cap);
+
+	for (n = 0, offset = 0; capture_next(&cap, &offset, &len) != NULL; ++n);
+
+	sim.bufs = calloc(n, sizeof *sim.bufs);
+	sim.lens = calloc(n, sizeof *sim.lens);
+	if (sim.bufs == NULL || sim.lens == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (first = 0, d = 0, offset = 0;
+			d < DUMPS && (buf = capture_next(&cap, &offset, &len))
+								!= NULL; ) {
+		sim.bufs[sim.num_bufs] = buf;
+		sim.lens[sim.num_bufs++] = len;
+		if (dump_done(buf, len)) {
+			sim.dumps[d].first = first;
+			sim.dumps[d++].end = sim.num_bufs;
+			first = sim.num_bufs;
+		}
+	}
+
+	if (d < DUMPS) {
+		fprintf(stderr, "%s: fewer than %d complete dumps\n", path,
+			DUMPS);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Returns the text response after a resync (which the caller must free) */
+static struct snapshot *resync(const unsigned inject_at, const int err)
+{
+	sim.recvs = 0;
+	sim.requests = 0;
+	sim.inject_at = inject_at;
+	sim.inject_errno = err;
+
+	cache_resync();
+	render_response();
+
+	return snapshot_get(current[FMT_TEXT]);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int errs[] = { ENOBUFS, EINTR };
+	struct snapshot *expected, *snap;
+	unsigned recvs, requests, i, e, failures;
+	int fds[2];
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s capture\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Log to stderr */
+	debug = 1;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) {
+		perror("socketpair");
+		return EXIT_FAILURE;
+	}
+
+	sim.fd = fds[0];
+	load(argv[1]);
+
+	expected = resync(-1, 0);
+	recvs = sim.recvs;
+	requests = sim.requests;
+	failures = 0;
+
+	for (e = 0; e < sizeof errs / sizeof errs[0]; ++e) {
+		for (i = 0; i < recvs; ++i) {
+
+			snap = resync(i, errs[e]);
+
+			if (snap->len != expected->len
+					|| memcmp(snap->data, expected->data,
+						  snap->len) != 0) {
+				fprintf(stderr, "%s before buffer %u: wrong "
+					"response\n", strerror(errs[e]), i);
+				++failures;
+			}
+
+			if (sim.requests != (errs[e] == ENOBUFS ? 2 : 1)
+								* requests) {
+				fprintf(stderr, "%s before buffer %u: %u dump "
+					"requests\n", strerror(errs[e]), i,
+					sim.requests);
+				++failures;
+			}
+
+			snapshot_put(snap);
+		}
+	}
+
+	printf("%u buffers, %u injected errors, %u failures\n", recvs,
+	       2 * recvs, failures);
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
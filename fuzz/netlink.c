@@ -0,0 +1,113 @@
+/*
+ * Copyright 2019 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *	http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Fuzz target for denatd's netlink parsers.  Each input is treated as one
+ * received buffer of netlink messages, which is fed through msg_cb (and then
+ * rendered in every format), starting from an empty cache.
+ *
+ *	clang -g -O1 -pthread -fsanitize=fuzzer,address,undefined \
+ *		-I/path/to/libmnl/include -o fuzz-netlink netlink.c -lmnl
+ *
+ * Without libFuzzer, build with -DFUZZ_STANDALONE to run the inputs named on
+ * the command line once each (e.g. to reproduce a crash).  The buffers in a
+ * capture (denatd -R|--record, or bench/parse -o) make a good seed corpus;
+ * split them out with -DFUZZ_STANDALONE and -s <capture> <directory>.
+ */
+
+#define main denatd_main
+#include "../denatd.c"
+#undef main
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *const data, const size_t size)
+{
+	/* Log to stderr (only warnings, which are expected) */
+	debug = 1;
+
+	cache_clear();
+	mnl_cb_run(data, size, 0, 0, msg_cb, NULL);
+	render_response();
+
+	return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+#include <limits.h>
+
+/* Writes each buffer in a capture to its own file, as a seed corpus */
+static void split_capture(const char *const path, const char *const dir)
+{
+	struct capture cap;
+	const uint8_t *buf;
+	size_t offset, len;
+	char name[PATH_MAX];
+	unsigned n;
+	int fd;
+
+	capture_load(path, &cap);
+
+	for (n = 0, offset = 0; (buf = capture_next(&cap, &offset, &len))
+							!= NULL; ++n) {
+		snprintf(name, sizeof name, "%s/seed-%04u", dir, n);
+		if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+			perror(name);
+			exit(EXIT_FAILURE);
+		}
+		write_all(fd, buf, len, name);
+		close(fd);
+	}
+
+	free(cap.data);
+}
+
+int main(int argc, char *argv[])
+{
+	struct capture input;
+	struct stat st;
+	int i, fd;
+
+	if (argc == 4 && strcmp(argv[1], "-s") == 0) {
+		split_capture(argv[2], argv[3]);
+		return EXIT_SUCCESS;
+	}
+
+	for (i = 1; i < argc; ++i) {
+
+		if ((fd = open(argv[i], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+			perror(argv[i]);
+			return EXIT_FAILURE;
+		}
+
+		input.len = st.st_size;
+		if ((input.data = malloc(input.len + 1)) == NULL
+				|| read(fd, input.data, input.len)
+						!= (ssize_t)input.len) {
+			perror(argv[i]);
+			return EXIT_FAILURE;
+		}
+
+		close(fd);
+		LLVMFuzzerTestOneInput(input.data, input.len);
+		free(input.data);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#endif /* FUZZ_STANDALONE */
@@ -0,0 +1,204 @@
+/*
+ * Copyright 2019 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Reader for denatd's shared snapshot (denatd -S|--shm; see "Shared snapshot"
+ * in denatd.c).  Header-only, so C programs can use it without libdenatc:
+ *
+ *	struct denat_shm shm;
+ *	uint64_t generation;
+ *	char body[65536];
+ *	ssize_t len;
+ *
+ *	if (denat_shm_open(&shm, "/run/denatd/snapshot") < 0)
+ *		...
+ *	if (denat_shm_changed(&shm))
+ *		len = denat_shm_read(&shm, body, sizeof body, &generation,
+ *				     NULL);
+ *
+ * The body is a TLV-format response.  Reads make no system calls, unless the
+ * file has grown since it was mapped.
+ */
+
+#ifndef DENAT_SHM_H
+#define DENAT_SHM_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DENAT_SHM_MAGIC		"DENATSH1"
+
+/* Attempts before giving up on a snapshot that's being updated */
+#define DENAT_SHM_RETRIES	1000
+
+/* Must match denatd.c */
+struct denat_shm_header {
+	char magic[sizeof DENAT_SHM_MAGIC - 1];
+	uint64_t seq;
+	uint64_t generation;
+	uint64_t etag;
+	uint64_t len;
+};
+
+struct denat_shm {
+	const struct denat_shm_header *hdr;
+	size_t size;
+	uint64_t seq;		/* of the last snapshot read */
+	int fd;
+};
+
+/* (Re)maps the whole file; returns -1 (with errno set) on error */
+static inline int denat_shm_map(struct denat_shm *const shm)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat(shm->fd, &st) < 0)
+		return -1;
+
+	if ((size_t)st.st_size < sizeof *shm->hdr) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, shm->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	if (shm->hdr != NULL)
+		munmap((void *)shm->hdr, shm->size);
+
+	shm->hdr = map;
+	shm->size = st.st_size;
+
+	return 0;
+}
+
+static inline void denat_shm_close(struct denat_shm *const shm)
+{
+	if (shm->hdr != NULL)
+		munmap((void *)shm->hdr, shm->size);
+	if (shm->fd >= 0)
+		close(shm->fd);
+
+	shm->hdr = NULL;
+	shm->fd = -1;
+}
+
+/* Returns -1 (with errno set) on error */
+static inline int denat_shm_open(struct denat_shm *const shm,
+				 const char *const path)
+{
+	shm->hdr = NULL;
+	shm->seq = 0;
+
+	if ((shm->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if (denat_shm_map(shm) < 0) {
+		denat_shm_close(shm);
+		return -1;
+	}
+
+	if (memcmp(shm->hdr->magic, DENAT_SHM_MAGIC,
+		   sizeof shm->hdr->magic) != 0) {
+		denat_shm_close(shm);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Copies the body into buf, if it fits, and returns its length (like
+ * snprintf(3), so a bigger buffer can be tried).  Either of generation and
+ * etag may be NULL.  Returns -1 with errno set to ENODATA if nothing has been
+ * published yet, or EAGAIN if the snapshot never stopped changing.
+ */
+static inline ssize_t denat_shm_read(struct denat_shm *const shm,
+				     void *const buf, const size_t size,
+				     uint64_t *const generation,
+				     uint64_t *const etag)
+{
+	uint64_t seq, gen, tag, len;
+	unsigned i;
+
+	for (i = 0; i < DENAT_SHM_RETRIES; ++i) {
+
+		seq = __atomic_load_n(&shm->hdr->seq, __ATOMIC_ACQUIRE);
+		if (seq == 0) {
+			errno = ENODATA;
+			return -1;
+		}
+
+		if (seq & 1)
+			continue;
+
+		gen = shm->hdr->generation;
+		tag = shm->hdr->etag;
+		len = shm->hdr->len;
+
+		/* Grown since it was mapped (or torn; seq is checked below) */
+		if (len > shm->size - sizeof *shm->hdr) {
+			if (denat_shm_map(shm) < 0)
+				return -1;
+			continue;
+		}
+
+		if (len <= size)
+			memcpy(buf, shm->hdr + 1, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->hdr->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		shm->seq = seq;
+		if (generation != NULL)
+			*generation = gen;
+		if (etag != NULL)
+			*etag = tag;
+
+		return len;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+/*
+ * Whether the snapshot has been updated since it was last read, which is
+ * cheaper to check than reading it.  Unlike the generation, this also works
+ * across denatd restarts.
+ */
+static inline int denat_shm_changed(const struct denat_shm *const shm)
+{
+	uint64_t seq;
+
+	/* The previous update, while one is in progress */
+	seq = __atomic_load_n(&shm->hdr->seq, __ATOMIC_ACQUIRE) & ~(uint64_t)1;
+
+	return seq != shm->seq;
+}
+
+#endif	/* DENAT_SHM_H */
@@ -15,8 +15,10 @@
  */
 
 #define _DEFAULT_SOURCE			/* for setgroups(2) */
+#define PY_SSIZE_T_CLEAN		/* Py_ssize_t lengths for "s#" */
 
 #include <Python.h>
+#include <structmember.h>
 
 /*
  * Verify that Python.h defined _GNU_SOURCE, which is required for setresuid(2)
@@ -35,11 +37,19 @@
 #include <sys/capability.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
+#include <net/if.h>
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <libmnl/libmnl.h>
+#include <linux/rtnetlink.h>
+
+#include "denat_shm.h"
+
 /*
  * Verify that we've got the GNU version of strerror_r(3)
  */
@@ -70,19 +80,151 @@ static char ce_docstr[] =
 /* The libdenatc.drop_root method */
 static PyObject *libdenatc_drop_root(PyObject *self, PyObject *args);
 
+/* The libdenatc.reconcile and libdenatc.default_gateway methods */
+static PyObject *libdenatc_reconcile(PyObject *self, PyObject *args);
+static PyObject *libdenatc_default_gateway(PyObject *self, PyObject *args);
+
+/* The libdenatc.parse method */
+static PyObject *libdenatc_parse(PyObject *self, PyObject *args);
+
 /* Module method table */
 static PyMethodDef methods[] = {
 	{ "drop_root", libdenatc_drop_root, METH_VARARGS, NULL },
+	{ "reconcile", libdenatc_reconcile, METH_VARARGS,
+	  "reconcile(interface, address, routes, protocol) -> changes\n\n"
+	  "Makes address (a /64, or None) the only global IPv6 address on\n"
+	  "interface, and routes (a sequence of (interface, destination)\n"
+	  "pairs, also /64) the only IPv6 routes with the given protocol.\n"
+	  "Returns a list of (action, kind, address, prefix length,\n"
+	  "interface, errno) tuples, where action is 'added', 'removed',\n"
+	  "'present', 'kept' (a private address) or 'missing' (no such\n"
+	  "interface), and kind is 'addr' or 'route'." },
+	{ "default_gateway", libdenatc_default_gateway, METH_VARARGS,
+	  "default_gateway(family) -> address\n\n"
+	  "The gateway of the main table's default route, or None." },
+	{ "parse", libdenatc_parse, METH_VARARGS,
+	  "parse(format, body, interface, uplink) -> Result\n\n"
+	  "Selects the public addresses of interface (which may be None)\n"
+	  "and the prefix delegated by uplink (or any uplink, if None) from\n"
+	  "a denatd response in 'text' or 'tlv' format." },
+	{ NULL, NULL, 0, NULL }
+};
+
+/* The libdenatc.Snapshot type (see "Shared snapshot" below) */
+struct snapshot {
+	PyObject_HEAD
+	struct denat_shm shm;
+	char *buf;
+	size_t size;
+};
+
+static int snapshot_init(PyObject *self, PyObject *args, PyObject *kwds);
+static void snapshot_dealloc(PyObject *self);
+static PyObject *snapshot_read(PyObject *self, PyObject *args);
+static PyObject *snapshot_changed(PyObject *self, PyObject *args);
+
+static PyMethodDef snapshot_methods[] = {
+	{ "read", snapshot_read, METH_NOARGS,
+	  "read() -> (generation, etag, body)\n\n"
+	  "The current snapshot; body is in denatd's TLV format." },
+	{ "changed", snapshot_changed, METH_NOARGS,
+	  "changed() -> bool\n\n"
+	  "Whether the snapshot has been updated since it was last read." },
 	{ NULL, NULL, 0, NULL }
 };
 
+static PyTypeObject snapshot_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name	= "libdenatc.Snapshot",
+	.tp_basicsize	= sizeof(struct snapshot),
+	.tp_dealloc	= snapshot_dealloc,
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "Snapshot(path)\n\n"
+			  "denatd's shared snapshot (denatd -S|--shm)",
+	.tp_methods	= snapshot_methods,
+	.tp_init	= snapshot_init,
+	.tp_new		= PyType_GenericNew,
+};
+
+/* The libdenatc.Result type (see "Responses" below) */
+struct result_key {
+	uint8_t have;			/* RESULT_* */
+	uint8_t plen;
+	uint8_t ipv4[4];
+	uint8_t ipv6[16];
+	uint8_t prefix[16];
+};
+
+struct result {
+	PyObject_HEAD
+	struct result_key key;
+	PyObject *ipv4;
+	PyObject *ipv6;
+	PyObject *prefix;
+	PyObject *uplink;
+	PyObject *expiries;
+	PyObject *log;
+	PyObject *tentative;
+	long hash;
+};
+
+static void result_dealloc(PyObject *self);
+static PyObject *result_richcompare(PyObject *a, PyObject *b, int op);
+static long result_hash(PyObject *self);
+static PyObject *result_repr(PyObject *self);
+
+static PyMemberDef result_members[] = {
+	{ "ipv4", T_OBJECT, offsetof(struct result, ipv4), READONLY,
+	  "The public IPv4 address (a string), or None" },
+	{ "ipv6", T_OBJECT, offsetof(struct result, ipv6), READONLY,
+	  "The public IPv6 address (a string), or None" },
+	{ "prefix", T_OBJECT, offsetof(struct result, prefix), READONLY,
+	  "The delegated prefix ('address/length'), or None" },
+	{ "uplink", T_OBJECT, offsetof(struct result, uplink), READONLY,
+	  "The uplink that delegated the prefix, if denatd named it" },
+	{ "expiries", T_OBJECT, offsetof(struct result, expiries), READONLY,
+	  "When the selected addresses and prefix expire (a tuple of\n"
+	  "Unix times), or None if the response had no lifetimes" },
+	{ "log", T_OBJECT, offsetof(struct result, log), READONLY,
+	  "(level, message) pairs for the logging module" },
+	{ "tentative", T_OBJECT, offsetof(struct result, tentative), READONLY,
+	  "Whether interface had an address still undergoing duplicate\n"
+	  "address detection" },
+	{ NULL, 0, 0, 0, NULL }
+};
+
+static PyTypeObject result_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name	= "libdenatc.Result",
+	.tp_basicsize	= sizeof(struct result),
+	.tp_dealloc	= result_dealloc,
+	.tp_repr	= result_repr,
+	.tp_hash	= result_hash,
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "The public addresses and prefix selected from a\n"
+			  "denatd response (see libdenatc.parse).  Results\n"
+			  "compare equal if they select the same addresses and\n"
+			  "prefix; the other attributes are ignored.",
+	.tp_richcompare	= result_richcompare,
+	.tp_members	= result_members,
+};
+
 /* Module init function */
 PyMODINIT_FUNC initlibdenatc(void)
 {
 	PyObject *module;
 
+	if (PyType_Ready(&snapshot_type) < 0 || PyType_Ready(&result_type) < 0)
+		return;
+
 	module = Py_InitModule(module_name, methods);
 
+	Py_INCREF(&snapshot_type);
+	PyModule_AddObject(module, "Snapshot", (PyObject *)&snapshot_type);
+
+	Py_INCREF(&result_type);
+	PyModule_AddObject(module, "Result", (PyObject *)&result_type);
+
 	ce_class = PyErr_NewExceptionWithDoc("libdenatc.CapabilityError",
 					     ce_docstr, PyExc_EnvironmentError,
 					     NULL);
@@ -214,3 +356,1349 @@ static PyObject *libdenatc_drop_root(PyObject *const self
 	return drop_root(uid, gid);
 }
 
+
+/*
+ * Shared snapshot
+ */
+
+static int snapshot_init(PyObject *const self, PyObject *const args,
+			 PyObject *const kwds __attribute__((unused)))
+{
+	struct snapshot *const snap = (struct snapshot *)self;
+	const char *path;
+
+	if (PyArg_ParseTuple(args, "s", &path) == 0)
+		return -1;
+
+	if (snap->shm.hdr != NULL)
+		denat_shm_close(&snap->shm);
+
+	if (denat_shm_open(&snap->shm, path) < 0) {
+		PyErr_SetFromErrnoWithFilename(PyExc_EnvironmentError, path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void snapshot_dealloc(PyObject *const self)
+{
+	struct snapshot *const snap = (struct snapshot *)self;
+
+	if (snap->shm.hdr != NULL)
+		denat_shm_close(&snap->shm);
+
+	free(snap->buf);
+	Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject *snapshot_read(PyObject *const self,
+			       PyObject *const args __attribute__((unused)))
+{
+	struct snapshot *const snap = (struct snapshot *)self;
+	uint64_t generation, etag;
+	char tag[17];
+	ssize_t len;
+	char *buf;
+
+	if (snap->shm.hdr == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Snapshot not open");
+		return NULL;
+	}
+
+	/* Until the body fits (it may grow between attempts) */
+	while ((len = denat_shm_read(&snap->shm, snap->buf, snap->size,
+				     &generation, &etag)) > (ssize_t)snap->size) {
+
+		if ((buf = realloc(snap->buf, len)) == NULL)
+			return PyErr_NoMemory();
+
+		snap->buf = buf;
+		snap->size = len;
+	}
+
+	if (len < 0)
+		return PyErr_SetFromErrno(PyExc_EnvironmentError);
+
+	/* The etag as it appears in OK frames */
+	snprintf(tag, sizeof tag, "%016llx", (unsigned long long)etag);
+
+	return Py_BuildValue("(Kss#)", (unsigned long long)generation, tag,
+			     snap->buf, (Py_ssize_t)len);
+}
+
+static PyObject *snapshot_changed(PyObject *const self,
+				  PyObject *const args __attribute__((unused)))
+{
+	struct snapshot *const snap = (struct snapshot *)self;
+
+	if (snap->shm.hdr == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Snapshot not open");
+		return NULL;
+	}
+
+	return PyBool_FromLong(denat_shm_changed(&snap->shm));
+}
+
+/*
+ * Netlink reconciliation
+ *
+ * Each call does one dump of the interface's IPv6 addresses and one of the
+ * IPv6 routes (filtered by the kernel, where it supports strict checking),
+ * works out the differences, and sends all of the changes in a single
+ * sendmsg(2).  The kernel handles them in order -- removals first -- and
+ * acknowledges each one, so a failure only affects its own change.
+ *
+ * The socket isn't explicitly bound (the kernel binds it on the first send),
+ * because denatc's SELinux policy doesn't allow it.
+ */
+
+/* Enough for any address or route message that denatc sends */
+#define RECONCILE_MSG_MAX	256
+
+struct change {
+	const char *action;
+	_Bool route;
+	uint16_t type;		/* RTM_{NEW,DEL}{ADDR,ROUTE}, or 0 for none */
+	struct in6_addr addr;
+	uint8_t plen;
+	uint32_t ifindex;
+	uint32_t table;
+	uint8_t rt_type;
+	char ifname[IF_NAMESIZE];
+	int error;
+};
+
+struct reconcile {
+	struct mnl_socket *nl;
+	uint32_t seq;
+	uint8_t protocol;
+	/* The address, on ifindex */
+	uint32_t ifindex;
+	const struct in6_addr *addr;
+	_Bool addr_present;
+	/* The routes; found is set for each one that exists */
+	struct change *routes;
+	unsigned num_routes;
+	_Bool *found;
+	/* The results */
+	struct change *changes;
+	unsigned num_changes;
+	unsigned max_changes;
+};
+
+static struct change *new_change(struct reconcile *const r,
+				 const char *const action, const _Bool route,
+				 const uint16_t type)
+{
+	struct change *c;
+
+	if (r->num_changes == r->max_changes) {
+		r->max_changes = r->max_changes ? r->max_changes * 2 : 16;
+		c = realloc(r->changes, r->max_changes * sizeof *c);
+		if (c == NULL)
+			return NULL;
+		r->changes = c;
+	}
+
+	c = &r->changes[r->num_changes++];
+	memset(c, 0, sizeof *c);
+	c->action = action;
+	c->route = route;
+	c->type = type;
+
+	return c;
+}
+
+struct attrs {
+	const struct nlattr **tb;
+	uint16_t max;
+};
+
+static int attr_cb(const struct nlattr *const attr, void *const data)
+{
+	const struct attrs *const attrs = data;
+
+	if (mnl_attr_type_valid(attr, attrs->max) < 0)
+		return MNL_CB_OK;
+
+	attrs->tb[mnl_attr_get_type(attr)] = attr;
+
+	return MNL_CB_OK;
+}
+
+/* Returns 0 if the message is malformed (and should be ignored) */
+static int parse_attrs(const struct nlmsghdr *const nlh, const size_t hdrlen,
+		       const struct nlattr **const tb, const uint16_t max)
+{
+	struct attrs attrs = { .tb = tb, .max = max };
+
+	memset(tb, 0, (max + 1) * sizeof *tb);
+
+	if (mnl_nlmsg_get_payload_len(nlh) < hdrlen)
+		return 0;
+
+	return mnl_attr_parse(nlh, hdrlen, attr_cb, &attrs) >= 0;
+}
+
+/* An attribute's payload, if it's len bytes long */
+static const void *attr_data(const struct nlattr *const attr, const size_t len)
+{
+	if (attr == NULL || mnl_attr_get_payload_len(attr) != len)
+		return NULL;
+
+	return mnl_attr_get_payload(attr);
+}
+
+/* An attribute's u32 value, or def */
+static uint32_t attr_u32(const struct nlattr *const attr, const uint32_t def)
+{
+	if (attr == NULL || mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
+		return def;
+
+	return mnl_attr_get_u32(attr);
+}
+
+/* The same addresses that netaddr's IPAddress.is_private() matches */
+static _Bool is_private(const struct in6_addr *const a)
+{
+	return (a->s6_addr[0] & 0xfe) == 0xfc			/* fc00::/7 */
+		|| (a->s6_addr[0] == 0xfe
+		    && (a->s6_addr[1] & 0xc0) == 0x80)		/* fe80::/10 */
+		|| (a->s6_addr[0] == 0xfe
+		    && (a->s6_addr[1] & 0xc0) == 0xc0);		/* fec0::/10 */
+}
+
+static void name_interface(struct change *const c)
+{
+	if (if_indextoname(c->ifindex, c->ifname) == NULL)
+		snprintf(c->ifname, sizeof c->ifname, "%" PRIu32, c->ifindex);
+}
+
+/* Returns MNL_CB_ERROR (with errno set) if out of memory */
+static int addr_cb(const struct nlmsghdr *const nlh, void *const data)
+{
+	const struct ifaddrmsg *const ifa = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *tb[IFA_MAX + 1];
+	struct reconcile *const r = data;
+	const struct in6_addr *addr;
+	struct change *c;
+
+	if (!parse_attrs(nlh, sizeof *ifa, tb, IFA_MAX)
+			|| ifa->ifa_family != AF_INET6
+			|| ifa->ifa_index != r->ifindex)
+		return MNL_CB_OK;
+
+	if ((addr = attr_data(tb[IFA_ADDRESS], sizeof *addr)) == NULL)
+		return MNL_CB_OK;
+
+	if (is_private(addr))
+		c = new_change(r, "kept", 0, 0);
+	else if (r->addr != NULL && ifa->ifa_prefixlen == 64
+			&& memcmp(addr, r->addr, sizeof *addr) == 0) {
+		c = new_change(r, "present", 0, 0);
+		r->addr_present = 1;
+	}
+	else
+		c = new_change(r, "removed", 0, RTM_DELADDR);
+
+	if (c == NULL)
+		return MNL_CB_ERROR;
+
+	c->addr = *addr;
+	c->plen = ifa->ifa_prefixlen;
+	c->ifindex = r->ifindex;
+	name_interface(c);
+
+	return MNL_CB_OK;
+}
+
+static int route_cb(const struct nlmsghdr *const nlh, void *const data)
+{
+	const struct rtmsg *const rtm = mnl_nlmsg_get_payload(nlh);
+	const struct nlattr *tb[RTA_MAX + 1];
+	struct reconcile *const r = data;
+	const struct in6_addr *dst;
+	uint32_t oif, table;
+	struct change *c;
+	unsigned i;
+
+	if (!parse_attrs(nlh, sizeof *rtm, tb, RTA_MAX)
+			|| rtm->rtm_family != AF_INET6
+			|| rtm->rtm_protocol != r->protocol
+			|| (rtm->rtm_flags & RTM_F_CLONED))
+		return MNL_CB_OK;
+
+	dst = attr_data(tb[RTA_DST], sizeof *dst);
+	oif = attr_u32(tb[RTA_OIF], 0);
+	table = attr_u32(tb[RTA_TABLE], rtm->rtm_table);
+
+	for (i = 0; i < r->num_routes; ++i) {
+		if (dst != NULL && rtm->rtm_dst_len == 64
+			    && oif == r->routes[i].ifindex
+			    && memcmp(dst, &r->routes[i].addr, sizeof *dst) == 0)
+			break;
+	}
+
+	if (i < r->num_routes) {
+		r->found[i] = 1;
+		c = new_change(r, "present", 1, 0);
+	}
+	else {
+		c = new_change(r, "removed", 1, RTM_DELROUTE);
+	}
+
+	if (c == NULL)
+		return MNL_CB_ERROR;
+
+	if (dst != NULL)
+		c->addr = *dst;
+	c->plen = rtm->rtm_dst_len;
+	c->ifindex = oif;
+	c->table = table;
+	c->rt_type = rtm->rtm_type;
+	name_interface(c);
+
+	return MNL_CB_OK;
+}
+
+/* Returns -1 (with errno set) on error */
+static int nl_dump(struct reconcile *const r, const uint16_t type,
+		   const void *const msg, const size_t len, mnl_cb_t cb,
+		   void *const data)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	ssize_t ret;
+
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_seq = ++r->seq;
+	memcpy(mnl_nlmsg_put_extra_header(nlh, len), msg, len);
+
+	if (mnl_socket_sendto(r->nl, nlh, nlh->nlmsg_len) < 0)
+		return -1;
+
+	do {
+		ret = mnl_socket_recvfrom(r->nl, buf, sizeof buf);
+		if (ret < 0)
+			return -1;
+		ret = mnl_cb_run(buf, ret, r->seq, 0, cb, data);
+	} while (ret > MNL_CB_STOP);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static void put_change(struct nlmsghdr *const nlh, const struct change *const c,
+		       const uint8_t protocol)
+{
+	struct ifaddrmsg *ifa;
+	struct rtmsg *rtm;
+
+	nlh->nlmsg_type = c->type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	if (c->type == RTM_NEWADDR || c->type == RTM_NEWROUTE)
+		nlh->nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+
+	if (!c->route) {
+		ifa = mnl_nlmsg_put_extra_header(nlh, sizeof *ifa);
+		ifa->ifa_family = AF_INET6;
+		ifa->ifa_prefixlen = c->plen;
+		ifa->ifa_index = c->ifindex;
+		mnl_attr_put(nlh, IFA_LOCAL, sizeof c->addr, &c->addr);
+		return;
+	}
+
+	rtm = mnl_nlmsg_put_extra_header(nlh, sizeof *rtm);
+	rtm->rtm_family = AF_INET6;
+	rtm->rtm_dst_len = c->plen;
+	rtm->rtm_protocol = protocol;
+	rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+	rtm->rtm_type = c->rt_type;
+	rtm->rtm_table = c->table < 256 ? c->table : RT_TABLE_UNSPEC;
+
+	if (c->plen != 0)
+		mnl_attr_put(nlh, RTA_DST, sizeof c->addr, &c->addr);
+	if (c->ifindex != 0)
+		mnl_attr_put_u32(nlh, RTA_OIF, c->ifindex);
+	mnl_attr_put_u32(nlh, RTA_TABLE, c->table);
+}
+
+/* Sends every change at once; returns -1 (with errno set) on error */
+static int nl_apply(struct reconcile *const r)
+{
+	const struct nlmsgerr *err;
+	struct nlmsghdr *nlh;
+	unsigned i, pending;
+	uint32_t first;
+	size_t len;
+	ssize_t ret;
+	char *buf;
+
+	len = r->num_changes * RECONCILE_MSG_MAX;
+	if (len < (size_t)MNL_SOCKET_BUFFER_SIZE)
+		len = MNL_SOCKET_BUFFER_SIZE;
+	if ((buf = malloc(len)) == NULL)
+		return -1;
+
+	/* Change i has sequence number first + i */
+	first = r->seq + 1;
+	pending = 0;
+	len = 0;
+
+	for (i = 0; i < r->num_changes; ++i) {
+
+		nlh = mnl_nlmsg_put_header(buf + len);
+		nlh->nlmsg_seq = first + i;
+		r->seq = nlh->nlmsg_seq;
+
+		if (r->changes[i].type == 0)
+			continue;
+
+		put_change(nlh, &r->changes[i], r->protocol);
+		len += nlh->nlmsg_len;
+		++pending;
+	}
+
+	if (pending != 0 && mnl_socket_sendto(r->nl, buf, len) < 0) {
+		free(buf);
+		return -1;
+	}
+
+	/* The results are in the acknowledgements */
+	while (pending != 0) {
+
+		ret = mnl_socket_recvfrom(r->nl, buf, MNL_SOCKET_BUFFER_SIZE);
+		if (ret < 0) {
+			free(buf);
+			return -1;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; mnl_nlmsg_ok(nlh, ret);
+					nlh = mnl_nlmsg_next(nlh, (int *)&ret)) {
+
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			i = nlh->nlmsg_seq - first;
+			if (i >= r->num_changes || r->changes[i].type == 0)
+				continue;
+
+			err = mnl_nlmsg_get_payload(nlh);
+			r->changes[i].error = -err->error;
+			--pending;
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+static PyObject *change_tuple(const struct change *const c)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (inet_ntop(AF_INET6, &c->addr, buf, sizeof buf) == NULL)
+		return PyErr_SetFromErrno(PyExc_OSError);
+
+	return Py_BuildValue("(sssBsi)", c->action, c->route ? "route" : "addr",
+			     buf, c->plen, c->ifname, c->error);
+}
+
+/* Parses the routes argument; returns -1 (with an exception set) on error */
+static int parse_routes(struct reconcile *const r, PyObject *const routes)
+{
+	PyObject *seq, *item;
+	const char *ifname, *dest;
+	struct change *rt;
+	unsigned i;
+
+	seq = PySequence_Fast(routes, "routes must be a sequence");
+	if (seq == NULL)
+		return -1;
+
+	r->num_routes = PySequence_Fast_GET_SIZE(seq);
+	r->routes = calloc(r->num_routes + 1, sizeof *r->routes);
+	r->found = calloc(r->num_routes + 1, sizeof *r->found);
+	if (r->routes == NULL || r->found == NULL) {
+		Py_DECREF(seq);
+		PyErr_NoMemory();
+		return -1;
+	}
+
+	for (i = 0; i < r->num_routes; ++i) {
+
+		item = PySequence_Fast_GET_ITEM(seq, i);
+		if (PyArg_ParseTuple(item, "ss", &ifname, &dest) == 0) {
+			Py_DECREF(seq);
+			return -1;
+		}
+
+		rt = &r->routes[i];
+		rt->route = 1;
+		rt->plen = 64;
+		rt->table = RT_TABLE_MAIN;
+		rt->rt_type = RTN_UNICAST;
+		snprintf(rt->ifname, sizeof rt->ifname, "%s", ifname);
+
+		if (inet_pton(AF_INET6, dest, &rt->addr) != 1) {
+			Py_DECREF(seq);
+			PyErr_Format(PyExc_ValueError,
+				     "Invalid route destination: %s", dest);
+			return -1;
+		}
+
+		/* Looked up by name, to save a dump */
+		rt->ifindex = if_nametoindex(ifname);
+	}
+
+	Py_DECREF(seq);
+	return 0;
+}
+
+static PyObject *reconcile(struct reconcile *const r, const char *const ifname)
+{
+	const struct ifaddrmsg ifa = {
+		.ifa_family = AF_INET6, .ifa_index = r->ifindex
+	};
+	const struct rtmsg rtm = {
+		.rtm_family = AF_INET6, .rtm_protocol = r->protocol
+	};
+	static const int one = 1;
+	PyObject *list, *item;
+	struct change *c;
+	unsigned i;
+
+	if ((r->nl = mnl_socket_open(NETLINK_ROUTE)) == NULL)
+		return PyErr_SetFromErrno(PyExc_OSError);
+
+	/* Lets the kernel filter the dumps; older kernels just ignore it */
+	setsockopt(mnl_socket_get_fd(r->nl), SOL_NETLINK,
+		   NETLINK_GET_STRICT_CHK, &one, sizeof one);
+
+	if (r->ifindex == 0) {
+		if ((c = new_change(r, "missing", 0, 0)) == NULL)
+			return PyErr_NoMemory();
+		if (r->addr != NULL)
+			c->addr = *r->addr;
+		c->plen = 64;
+		snprintf(c->ifname, sizeof c->ifname, "%s", ifname);
+	}
+	else if (nl_dump(r, RTM_GETADDR, &ifa, sizeof ifa, addr_cb, r) < 0) {
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+
+	if (r->addr != NULL && r->ifindex != 0 && !r->addr_present) {
+		if ((c = new_change(r, "added", 0, RTM_NEWADDR)) == NULL)
+			return PyErr_NoMemory();
+		c->addr = *r->addr;
+		c->plen = 64;
+		c->ifindex = r->ifindex;
+		snprintf(c->ifname, sizeof c->ifname, "%s", ifname);
+	}
+
+	if (nl_dump(r, RTM_GETROUTE, &rtm, sizeof rtm, route_cb, r) < 0)
+		return PyErr_SetFromErrno(PyExc_OSError);
+
+	for (i = 0; i < r->num_routes; ++i) {
+		if (r->found[i])
+			continue;
+		if (r->routes[i].ifindex == 0)
+			c = new_change(r, "missing", 1, 0);
+		else
+			c = new_change(r, "added", 1, RTM_NEWROUTE);
+		if (c == NULL)
+			return PyErr_NoMemory();
+		c->addr = r->routes[i].addr;
+		c->plen = r->routes[i].plen;
+		c->ifindex = r->routes[i].ifindex;
+		c->table = r->routes[i].table;
+		c->rt_type = r->routes[i].rt_type;
+		memcpy(c->ifname, r->routes[i].ifname, sizeof c->ifname);
+	}
+
+	if (nl_apply(r) < 0)
+		return PyErr_SetFromErrno(PyExc_OSError);
+
+	if ((list = PyList_New(r->num_changes)) == NULL)
+		return NULL;
+
+	for (i = 0; i < r->num_changes; ++i) {
+		if ((item = change_tuple(&r->changes[i])) == NULL) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+
+	return list;
+}
+
+static PyObject *libdenatc_reconcile(PyObject *const self
+						__attribute__((unused)),
+				     PyObject *const args)
+{
+	struct reconcile r = { .nl = NULL };
+	const char *ifname, *address;
+	struct in6_addr addr;
+	PyObject *routes, *ret;
+
+	if (PyArg_ParseTuple(args, "szOB", &ifname, &address, &routes,
+			     &r.protocol) == 0)
+		return NULL;
+
+	if (address != NULL) {
+		if (inet_pton(AF_INET6, address, &addr) != 1) {
+			PyErr_Format(PyExc_ValueError, "Invalid address: %s",
+				     address);
+			return NULL;
+		}
+		r.addr = &addr;
+	}
+
+	r.ifindex = if_nametoindex(ifname);
+
+	if (parse_routes(&r, routes) < 0)
+		ret = NULL;
+	else
+		ret = reconcile(&r, ifname);
+
+	if (r.nl != NULL)
+		mnl_socket_close(r.nl);
+	free(r.routes);
+	free(r.found);
+	free(r.changes);
+
+	return ret;
+}
+
+/*
+ * Default gateway, for when the firewall's address isn't configured
+ */
+
+struct gateway {
+	int family;
+	char addr[16];
+	_Bool found;
+};
+
+static int gateway_cb(const struct nlmsghdr *const nlh, void *const data)
+{
+	const struct rtmsg *const rtm = mnl_nlmsg_get_payload(nlh);
+	struct gateway *const gw = data;
+	const size_t len = (gw->family == AF_INET) ? 4 : 16;
+	const struct nlattr *tb[RTA_MAX + 1];
+	const void *addr;
+
+	if (gw->found || !parse_attrs(nlh, sizeof *rtm, tb, RTA_MAX)
+			|| rtm->rtm_family != gw->family
+			|| rtm->rtm_dst_len != 0 || rtm->rtm_type != RTN_UNICAST
+			|| attr_u32(tb[RTA_TABLE], rtm->rtm_table)
+							!= RT_TABLE_MAIN)
+		return MNL_CB_OK;
+
+	if ((addr = attr_data(tb[RTA_GATEWAY], len)) != NULL) {
+		memcpy(gw->addr, addr, len);
+		gw->found = 1;
+	}
+
+	return MNL_CB_OK;
+}
+
+static PyObject *libdenatc_default_gateway(PyObject *const self
+						__attribute__((unused)),
+					   PyObject *const args)
+{
+	struct reconcile r = { .nl = NULL };
+	struct gateway gw = { .found = 0 };
+	char buf[INET6_ADDRSTRLEN];
+	struct rtmsg rtm;
+	int ret;
+
+	if (PyArg_ParseTuple(args, "i", &gw.family) == 0)
+		return NULL;
+
+	if (gw.family != AF_INET && gw.family != AF_INET6) {
+		PyErr_Format(PyExc_ValueError, "Invalid address family: %d",
+			     gw.family);
+		return NULL;
+	}
+
+	memset(&rtm, 0, sizeof rtm);
+	rtm.rtm_family = gw.family;
+	rtm.rtm_table = RT_TABLE_MAIN;
+
+	if ((r.nl = mnl_socket_open(NETLINK_ROUTE)) == NULL)
+		return PyErr_SetFromErrno(PyExc_OSError);
+
+	ret = nl_dump(&r, RTM_GETROUTE, &rtm, sizeof rtm, gateway_cb, &gw);
+	mnl_socket_close(r.nl);
+
+	if (ret < 0)
+		return PyErr_SetFromErrno(PyExc_OSError);
+
+	if (!gw.found)
+		Py_RETURN_NONE;
+
+	return PyString_FromString(inet_ntop(gw.family, gw.addr, buf,
+					     sizeof buf));
+}
+
+/*
+ * Responses
+ *
+ * libdenatc.parse does what denatc used to do in Python for every response:
+ * split it into records, pick out the configured interface's public
+ * addresses and the configured uplink's prefix, and find out when they
+ * expire.  The result is immutable, and compares (and hashes) by a packed
+ * copy of the selection, so a response that doesn't change anything costs
+ * the interpreter one comparison.
+ */
+
+/* Record types and address flags in the 'tlv' format (see denatd.c) */
+#define TLV_LINK		1
+#define TLV_ADDR4		2
+#define TLV_ADDR6		3
+#define TLV_PREFIX		4
+#define TLV_LIFETIME		5
+#define TLV_LABEL		6
+
+#define TLV_F_TENTATIVE		0x02
+#define TLV_F_DEPRECATED	0x04
+#define TLV_F_DADFAILED		0x08
+
+/* Addresses that can't be used yet, or shouldn't be any more */
+#define TLV_F_UNUSABLE	(TLV_F_TENTATIVE | TLV_F_DEPRECATED | TLV_F_DADFAILED)
+
+/* Never expires (lifetime) */
+#define LIFETIME_INFINITE	0xffffffff
+
+/* Longer prefixes are too small to be delegated */
+#define DELEGATED_PLEN_MAX	56
+
+#define RESULT_IPV4		0x01
+#define RESULT_IPV6		0x02
+#define RESULT_PREFIX		0x04
+
+/* Levels of the logging module */
+#define LOG_LEVEL_DEBUG		10
+#define LOG_LEVEL_WARNING	30
+
+/* An address or prefix */
+struct record {
+	int family;		/* AF_INET or AF_INET6 */
+	_Bool prefix;
+	_Bool on_if;		/* on the configured interface? */
+	uint32_t ifindex;
+	uint8_t plen;
+	uint8_t flags;
+	uint8_t addr[16];
+	const char *uplink;	/* prefixes; not NUL-terminated */
+	size_t uplink_len;
+	const char *label;	/* IPv4 label (tlv); not NUL-terminated */
+	size_t label_len;
+	_Bool has_lifetime;
+	uint32_t lifetime[2];	/* preferred, valid */
+};
+
+struct parse {
+	const char *interface;
+	const char *uplink;
+	/* The configured interface's index (tlv) */
+	uint32_t ifindex;
+	_Bool have_ifindex;
+	struct record *records;
+	size_t num_records;
+	size_t max_records;
+	_Bool lifetimes;	/* any lifetime records? */
+	PyObject *log;
+};
+
+static struct record *new_record(struct parse *const p)
+{
+	struct record *r;
+
+	if (p->num_records == p->max_records) {
+		p->max_records = p->max_records ? p->max_records * 2 : 16;
+		r = realloc(p->records, p->max_records * sizeof *r);
+		if (r == NULL) {
+			PyErr_NoMemory();
+			return NULL;
+		}
+		p->records = r;
+	}
+
+	r = &p->records[p->num_records++];
+	memset(r, 0, sizeof *r);
+
+	return r;
+}
+
+/* Adds a message to the result's log; returns -1 on error */
+static int log_msg(struct parse *const p, const int level,
+		   const char *const format, ...)
+{
+	PyObject *item;
+	va_list ap;
+	char buf[200];
+	int ret;
+
+	va_start(ap, format);
+	vsnprintf(buf, sizeof buf, format, ap);
+	va_end(ap);
+
+	if ((item = Py_BuildValue("(is)", level, buf)) == NULL)
+		return -1;
+
+	ret = PyList_Append(p->log, item);
+	Py_DECREF(item);
+
+	return ret;
+}
+
+static const char *record_str(const struct record *const r, char *const buf,
+			      const size_t size)
+{
+	size_t len;
+
+	if (inet_ntop(r->family, r->addr, buf, size) == NULL)
+		return "?";
+
+	if (r->prefix) {
+		len = strlen(buf);
+		snprintf(buf + len, size - len, "/%u", r->plen);
+	}
+
+	return buf;
+}
+
+/* True if any of the first plen bits of addr match net */
+static _Bool in_net(const uint8_t *const addr, const uint8_t *const net,
+		    const unsigned plen)
+{
+	unsigned i;
+
+	for (i = 0; i < plen / 8; ++i) {
+		if (addr[i] != net[i])
+			return 0;
+	}
+
+	return plen % 8 == 0
+		|| ((addr[i] ^ net[i]) & (0xff00 >> (plen % 8))) == 0;
+}
+
+/*
+ * Whether an address is public, as netaddr sees it: not reserved, private,
+ * multicast, loopback, link-local, IPv4-mapped or IPv4-compatible.  For IPv6,
+ * netaddr reserves everything outside 2000::/3 that isn't in one of the other
+ * categories.
+ */
+static _Bool is_public(const struct record *const r)
+{
+	static const struct {
+		uint8_t net[4];
+		uint8_t plen;
+	} v4[] = {
+		{ {   0,   0,   0, 0 },  8 },	/* "this" network */
+		{ {  10,   0,   0, 0 },  8 },	/* private */
+		{ { 100,  64,   0, 0 }, 10 },	/* shared (CGN) */
+		{ { 127,   0,   0, 0 },  8 },	/* loopback */
+		{ { 169, 254,   0, 0 }, 16 },	/* link-local */
+		{ { 172,  16,   0, 0 }, 12 },	/* private */
+		{ { 192,   0,   0, 0 }, 24 },	/* IETF protocols */
+		{ { 192,   0,   2, 0 }, 24 },	/* TEST-NET-1 */
+		{ { 192, 168,   0, 0 }, 16 },	/* private */
+		{ { 198,  18,   0, 0 }, 15 },	/* benchmarking */
+		{ { 198,  51, 100, 0 }, 24 },	/* TEST-NET-2 */
+		{ { 203,   0, 113, 0 }, 24 },	/* TEST-NET-3 */
+		{ { 224,   0,   0, 0 },  3 },	/* multicast, reserved */
+	};
+	static const uint8_t global6[16] = { 0x20 };
+	unsigned i;
+
+	if (r->family == AF_INET6)
+		return in_net(r->addr, global6, 3);
+
+	for (i = 0; i < sizeof v4 / sizeof v4[0]; ++i) {
+		if (in_net(r->addr, v4[i].net, v4[i].plen))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Returns -1 (with an exception set) on error */
+static int parse_tlv(struct parse *const p, const uint8_t *const body,
+		     const size_t len)
+{
+	struct record *r, *last;
+	const uint8_t *value;
+	uint32_t ifindex;
+	size_t off, vlen;
+	char buf[INET6_ADDRSTRLEN];
+
+	last = NULL;
+
+	for (off = 0; off + 3 <= len; off += 3 + vlen) {
+
+		vlen = body[off + 1] << 8 | body[off + 2];
+		value = body + off + 3;
+
+		if (off + 3 + vlen > len) {
+			PyErr_SetString(PyExc_ValueError,
+					"Truncated TLV record");
+			return -1;
+		}
+
+		switch (body[off]) {
+
+		case TLV_LINK:
+			if (vlen < 4 || p->interface == NULL)
+				break;
+			memcpy(&ifindex, value, 4);
+			if (strlen(p->interface) == vlen - 4 && memcmp(
+				    value + 4, p->interface, vlen - 4) == 0) {
+				p->ifindex = ntohl(ifindex);
+				p->have_ifindex = 1;
+			}
+			break;
+
+		case TLV_ADDR4:
+		case TLV_ADDR6:
+			if (vlen != 6u + (body[off] == TLV_ADDR4 ? 4 : 16))
+				break;
+			if ((r = new_record(p)) == NULL)
+				return -1;
+			r->family = body[off] == TLV_ADDR4 ? AF_INET : AF_INET6;
+			memcpy(&ifindex, value, 4);
+			r->ifindex = ntohl(ifindex);
+			r->plen = value[4];
+			r->flags = value[5];
+			memcpy(r->addr, value + 6, vlen - 6);
+			last = r;
+			if (!(r->flags & TLV_F_UNUSABLE))
+				break;
+			if (log_msg(p, LOG_LEVEL_DEBUG, "Ignoring unusable "
+				    "address (flags %#x): %s", r->flags,
+				    record_str(r, buf, sizeof buf)) < 0)
+				return -1;
+			last = NULL;
+			break;
+
+		case TLV_PREFIX:
+			if (vlen < 18)
+				break;
+			if ((r = new_record(p)) == NULL)
+				return -1;
+			r->family = AF_INET6;
+			r->prefix = 1;
+			r->plen = value[0];
+			r->flags = value[1];
+			memcpy(r->addr, value + 2, 16);
+			r->uplink = (const char *)value + 18;
+			r->uplink_len = vlen - 18;
+			last = r;
+			break;
+
+		case TLV_LIFETIME:
+			if (vlen < 8)
+				break;
+			p->lifetimes = 1;
+			if (last == NULL)
+				break;
+			memcpy(last->lifetime, value, 8);
+			last->lifetime[0] = ntohl(last->lifetime[0]);
+			last->lifetime[1] = ntohl(last->lifetime[1]);
+			last->has_lifetime = 1;
+			break;
+
+		case TLV_LABEL:
+			/* Follows its address, like the lifetime */
+			if (p->num_records == 0)
+				break;
+			r = &p->records[p->num_records - 1];
+			if (r->prefix)
+				break;
+			r->label = (const char *)value;
+			r->label_len = vlen;
+			break;
+		}
+	}
+
+	/*
+	 * The interface's index may follow its addresses.  A labelled address
+	 * is on the interface only by its label, as in the text format.
+	 */
+	for (r = p->records; r < p->records + p->num_records; ++r) {
+		if (r->prefix)
+			continue;
+		if (r->label != NULL)
+			r->on_if = p->interface != NULL
+				&& strlen(p->interface) == r->label_len
+				&& memcmp(r->label, p->interface,
+					  r->label_len) == 0;
+		else
+			r->on_if = p->have_ifindex && r->ifindex == p->ifindex;
+	}
+
+	return 0;
+}
+
+/* Lines of whitespace-separated fields; returns -1 on error */
+static int parse_text(struct parse *const p, const char *body, size_t len)
+{
+	const char *line, *end, *f[3], *slash;
+	size_t flen[3], n;
+	struct record *r;
+	char buf[INET6_ADDRSTRLEN + 4];
+	unsigned long plen;
+	char *endp;
+
+	for (line = body; line < body + len; line = end + 1) {
+
+		if ((end = memchr(line, '\n', body + len - line)) == NULL)
+			end = body + len;
+
+		for (n = 0; n < 3 && line < end; ) {
+			while (line < end && isspace((unsigned char)*line))
+				++line;
+			if (line == end)
+				break;
+			f[n] = line;
+			while (line < end && !isspace((unsigned char)*line))
+				++line;
+			flen[n] = line - f[n];
+			++n;
+		}
+
+		if (n < 2 || flen[1] >= sizeof buf)
+			continue;
+
+		memcpy(buf, f[1], flen[1]);
+		buf[flen[1]] = 0;
+
+		if (flen[0] == 10 && memcmp(f[0], "__PREFIX__", 10) == 0) {
+			if ((slash = strchr(buf, '/')) == NULL)
+				continue;
+			buf[slash - buf] = 0;
+			plen = strtoul(slash + 1, &endp, 10);
+			if (*endp != 0 || plen > 128)
+				continue;
+			if ((r = new_record(p)) == NULL)
+				return -1;
+			if (inet_pton(AF_INET6, buf, r->addr) != 1) {
+				--p->num_records;
+				continue;
+			}
+			r->family = AF_INET6;
+			r->prefix = 1;
+			r->plen = plen;
+			if (n > 2) {
+				r->uplink = f[2];
+				r->uplink_len = flen[2];
+			}
+			continue;
+		}
+
+		if (p->interface == NULL || strlen(p->interface) != flen[0]
+				|| memcmp(f[0], p->interface, flen[0]) != 0)
+			continue;
+
+		if ((r = new_record(p)) == NULL)
+			return -1;
+
+		r->on_if = 1;
+		if (inet_pton(AF_INET6, buf, r->addr) == 1)
+			r->family = AF_INET6;
+		else if (inet_pton(AF_INET, buf, r->addr) == 1)
+			r->family = AF_INET;
+		else
+			--p->num_records;
+	}
+
+	return 0;
+}
+
+/* Same order as the Python it replaced: prefixes, then addresses */
+static int select_records(struct parse *const p,
+			  const struct record **const sel, _Bool *const tentative)
+{
+	struct record *r;
+	char buf[INET6_ADDRSTRLEN + 4];
+	int i;
+
+	for (r = p->records; r < p->records + p->num_records; ++r) {
+
+		if (!r->prefix)
+			continue;
+
+		if (p->uplink != NULL && (strlen(p->uplink) != r->uplink_len
+				|| memcmp(r->uplink, p->uplink,
+					  r->uplink_len) != 0))
+			continue;
+
+		if (r->plen > DELEGATED_PLEN_MAX) {
+			if (log_msg(p, LOG_LEVEL_WARNING, "Ignoring prefix: %s",
+				    record_str(r, buf, sizeof buf)) < 0)
+				return -1;
+			continue;
+		}
+
+		if (sel[2] != NULL) {
+			if (log_msg(p, LOG_LEVEL_WARNING,
+				    "Ignoring extra prefix: %s",
+				    record_str(r, buf, sizeof buf)) < 0)
+				return -1;
+			continue;
+		}
+
+		sel[2] = r;
+	}
+
+	for (r = p->records; r < p->records + p->num_records; ++r) {
+
+		if (r->prefix || !r->on_if || (r->flags & TLV_F_UNUSABLE)
+				|| !is_public(r))
+			continue;
+
+		i = r->family == AF_INET6;
+
+		if (sel[i] != NULL) {
+			if (log_msg(p, LOG_LEVEL_WARNING,
+				    "Ignoring extra public address: %s",
+				    record_str(r, buf, sizeof buf)) < 0)
+				return -1;
+			continue;
+		}
+
+		sel[i] = r;
+	}
+
+	/* Checked again (by denatc) once it should be usable */
+	*tentative = 0;
+	for (r = p->records; r < p->records + p->num_records; ++r) {
+		if (!r->prefix && r->on_if && (r->flags & TLV_F_TENTATIVE))
+			*tentative = 1;
+	}
+
+	return 0;
+}
+
+static PyObject *record_obj(const struct record *const r)
+{
+	char buf[INET6_ADDRSTRLEN + 4];
+
+	if (r == NULL)
+		Py_RETURN_NONE;
+
+	return PyString_FromString(record_str(r, buf, sizeof buf));
+}
+
+static int fill_result(struct parse *const p, struct result *const res)
+{
+	const struct record *sel[3] = { NULL, NULL, NULL };
+	PyObject *expiries, *t;
+	_Bool tentative;
+	unsigned i, j;
+
+	if (select_records(p, sel, &tentative) < 0)
+		return -1;
+
+	res->tentative = PyBool_FromLong(tentative);
+
+	if (sel[0] != NULL) {
+		res->key.have |= RESULT_IPV4;
+		memcpy(res->key.ipv4, sel[0]->addr, 4);
+	}
+	if (sel[1] != NULL) {
+		res->key.have |= RESULT_IPV6;
+		memcpy(res->key.ipv6, sel[1]->addr, 16);
+	}
+	if (sel[2] != NULL) {
+		res->key.have |= RESULT_PREFIX;
+		res->key.plen = sel[2]->plen;
+		memcpy(res->key.prefix, sel[2]->addr, 16);
+	}
+
+	if ((res->ipv4 = record_obj(sel[0])) == NULL
+			|| (res->ipv6 = record_obj(sel[1])) == NULL
+			|| (res->prefix = record_obj(sel[2])) == NULL)
+		return -1;
+
+	if (sel[2] != NULL && sel[2]->uplink_len != 0) {
+		res->uplink = PyString_FromStringAndSize(sel[2]->uplink,
+							 sel[2]->uplink_len);
+		if (res->uplink == NULL)
+			return -1;
+	}
+	else {
+		Py_INCREF(Py_None);
+		res->uplink = Py_None;
+	}
+
+	if (!p->lifetimes) {
+		Py_INCREF(Py_None);
+		res->expiries = Py_None;
+	}
+	else {
+		if ((expiries = PyList_New(0)) == NULL)
+			return -1;
+		for (i = 0; i < 3; ++i) {
+			for (j = 0; sel[i] != NULL && sel[i]->has_lifetime
+							&& j < 2; ++j) {
+				if (sel[i]->lifetime[j] == LIFETIME_INFINITE)
+					continue;
+				t = PyInt_FromLong(sel[i]->lifetime[j]);
+				if (t == NULL || PyList_Append(expiries, t) < 0) {
+					Py_XDECREF(t);
+					Py_DECREF(expiries);
+					return -1;
+				}
+				Py_DECREF(t);
+			}
+		}
+		res->expiries = PyList_AsTuple(expiries);
+		Py_DECREF(expiries);
+		if (res->expiries == NULL)
+			return -1;
+	}
+
+	if ((res->log = PyList_AsTuple(p->log)) == NULL)
+		return -1;
+
+	res->hash = -1;
+	return 0;
+}
+
+static PyObject *libdenatc_parse(PyObject *const self __attribute__((unused)),
+				 PyObject *const args)
+{
+	struct parse p = { .records = NULL };
+	const char *format, *body;
+	struct result *res;
+	Py_ssize_t len;
+	int ret;
+
+	if (PyArg_ParseTuple(args, "ss#zz", &format, &body, &len, &p.interface,
+			     &p.uplink) == 0)
+		return NULL;
+
+	if (strcmp(format, "tlv") != 0 && strcmp(format, "text") != 0) {
+		PyErr_Format(PyExc_ValueError, "Unsupported format: %s",
+			     format);
+		return NULL;
+	}
+
+	if ((p.log = PyList_New(0)) == NULL)
+		return NULL;
+
+	res = PyObject_New(struct result, &result_type);
+	if (res == NULL) {
+		Py_DECREF(p.log);
+		return NULL;
+	}
+
+	memset(&res->key, 0, sizeof *res - offsetof(struct result, key));
+
+	if (format[1] == 'l')
+		ret = parse_tlv(&p, (const uint8_t *)body, len);
+	else
+		ret = parse_text(&p, body, len);
+
+	if (ret == 0)
+		ret = fill_result(&p, res);
+
+	free(p.records);
+	Py_DECREF(p.log);
+
+	if (ret < 0) {
+		Py_DECREF(res);
+		return NULL;
+	}
+
+	return (PyObject *)res;
+}
+
+static void result_dealloc(PyObject *const self)
+{
+	struct result *const res = (struct result *)self;
+
+	Py_XDECREF(res->ipv4);
+	Py_XDECREF(res->ipv6);
+	Py_XDECREF(res->prefix);
+	Py_XDECREF(res->uplink);
+	Py_XDECREF(res->expiries);
+	Py_XDECREF(res->log);
+	Py_XDECREF(res->tentative);
+	PyObject_Del(self);
+}
+
+static PyObject *result_richcompare(PyObject *const a, PyObject *const b,
+				    const int op)
+{
+	const struct result *ra, *rb;
+	int equal;
+
+	if (!PyObject_TypeCheck(a, &result_type)
+			|| !PyObject_TypeCheck(b, &result_type)
+			|| (op != Py_EQ && op != Py_NE)) {
+		Py_INCREF(Py_NotImplemented);
+		return Py_NotImplemented;
+	}
+
+	ra = (const struct result *)a;
+	rb = (const struct result *)b;
+	equal = memcmp(&ra->key, &rb->key, sizeof ra->key) == 0;
+
+	return PyBool_FromLong(op == Py_EQ ? equal : !equal);
+}
+
+/* FNV-1a, like denatd's etags */
+static long result_hash(PyObject *const self)
+{
+	struct result *const res = (struct result *)self;
+	const uint8_t *const key = (const uint8_t *)&res->key;
+	uint64_t hash;
+	size_t i;
+
+	if (res->hash != -1)
+		return res->hash;
+
+	hash = 0xcbf29ce484222325ULL;
+	for (i = 0; i < sizeof res->key; ++i) {
+		hash ^= key[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	res->hash = (long)hash;
+	if (res->hash == -1)
+		res->hash = -2;
+
+	return res->hash;
+}
+
+static PyObject *result_repr(PyObject *const self)
+{
+	const struct result *const res = (const struct result *)self;
+	PyObject *ipv4, *ipv6, *prefix, *repr;
+
+	ipv4 = PyObject_Repr(res->ipv4);
+	ipv6 = PyObject_Repr(res->ipv6);
+	prefix = PyObject_Repr(res->prefix);
+
+	if (ipv4 == NULL || ipv6 == NULL || prefix == NULL)
+		repr = NULL;
+	else
+		repr = PyString_FromFormat("<libdenatc.Result ipv4=%s ipv6=%s "
+					   "prefix=%s>",
+					   PyString_AsString(ipv4),
+					   PyString_AsString(ipv6),
+					   PyString_AsString(prefix));
+
+	Py_XDECREF(ipv4);
+	Py_XDECREF(ipv6);
+	Py_XDECREF(prefix);
+
+	return repr;
+}
@@ -1,15 +1,22 @@
 from distutils.core import setup, Extension
 
 long_desc = '''
-Python wrappers for C functions used by denatc.  Currently, this
-library contains a single function, libdenatc.drop_root, which
+Python wrappers for C functions used by denatc.  libdenatc.drop_root
 drops root privileges (by changing to the UID and GID of a non-
 root user) while retaining the CAP_NET_ADMIN capability.
+libdenatc.Snapshot reads the snapshot that denatd publishes in
+shared memory (denatd -S|--shm); denat_shm.h is the equivalent C
+API.  libdenatc.reconcile updates the host's address and routes
+with a single batch of netlink (libmnl) messages, and
+libdenatc.default_gateway finds the firewall's address.
+libdenatc.parse selects the public addresses and prefix from a
+denatd response, as an immutable libdenatc.Result.
 '''
 
 extension = Extension('libdenatc',
 		      sources = [ 'libdenatc.c' ],
-		      libraries = [ 'cap' ]
+		      depends = [ 'denat_shm.h' ],
+		      libraries = [ 'cap', 'mnl' ]
 );
 
 setup(name = 'libdenatc',